@@ -0,0 +1,1289 @@
+/**
+ * © Copyright 2013 Carl N. Baldwin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The LCS engines and the merge built on them.
+ *
+ * This file is included by textile.c once for each type of symbol that is
+ * merged.  Bytes are merged as they are.  Tokens are interned to 32 bit IDs
+ * first.  UTF-16 text is merged by 16 bit code units.  The engines only ever
+ * compare two symbols for equality so the same code serves all of them.  The
+ * engines that rely on there being only 256 distinct bytes are only compiled
+ * for bytes.
+ *
+ * The includer defines:
+ *
+ * SYMBOL - Type of the symbols.
+ * SYMBOL_SIGNED - The signed type of the same width.
+ * SYMBOL_NAME(name) - name with a suffix for the type of symbol.
+ * SYMBOL_NEWLINE - The symbol that ends a line.
+ * SYMBOL_BYTES - Defined if the symbols are the bytes of the text.
+ */
+
+#define ENTRY_TYPE unsigned char
+#define ENTRY_SIGNED signed char
+#define ENTRY_NAME(name) SYMBOL_NAME(name##_8)
+#include "lcs_table.h"
+#undef ENTRY_NAME
+#undef ENTRY_SIGNED
+#undef ENTRY_TYPE
+
+#define ENTRY_TYPE unsigned short
+#define ENTRY_SIGNED short
+#define ENTRY_NAME(name) SYMBOL_NAME(name##_16)
+#include "lcs_table.h"
+#undef ENTRY_NAME
+#undef ENTRY_SIGNED
+#undef ENTRY_TYPE
+
+#define ENTRY_TYPE uint32_t
+#define ENTRY_SIGNED int32_t
+#define ENTRY_NAME(name) SYMBOL_NAME(name##_32)
+#include "lcs_table.h"
+#undef ENTRY_NAME
+#undef ENTRY_SIGNED
+#undef ENTRY_TYPE
+
+/* lcs_table
+ *
+ * Computes the longest common substring of the two strings passed.
+ *
+ * x - pointer to the first string (not null-terminated)
+ * m - length of the first string
+ * y - pointer to the second string (not null-terminated)
+ * n - length of the second string
+ *
+ * result - A string of struct textile_match that represents the result.
+ *          It is assumed that memory has been allocated sufficient to hold
+ *          the result which could be as long as the shorter of the two
+ *          strings.
+ * length - The length of the result goes here.
+ *
+ * Returns false without a result if memory for the table runs out.
+ *
+ * This algorithm was based on the LCS section of "Introduction to Algoritms"
+ * by Thomas Cormen, Charles Leiserson, Ronald Rivest and Clifford Stein.
+ *
+ * A few improvements have been made:
+ *
+ * 1) I run the algorithm backwards compare to the book.  This tends to find
+ *    matches earlier in the string.
+ * 2) I added the "g" table which allows me to find an LCS with the most
+ *    "grouping" possible.  This is because merging is more difficult when
+ *    the common parts are found fragmented all throughout the original strings.
+ *    Conflicts are also much more difficult to understand.
+ *    Note that this optimization doubles the already greedy memory requirements
+ *    of this algorithm.  It most likely adds a constant factor to the runtime
+ *    as well.
+ *
+ * The table needs m * n entries.  Each entry is as narrow as the length of
+ * the shorter string allows.  See lcs() for how bigger problems are handled.
+ */
+static bool
+SYMBOL_NAME(lcs_table)(const struct textile_options *options,
+                       const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                       struct textile_match *result, size_t *length)
+{
+    if (! (x && m && y && n && result)) {
+        *length = 0;
+        return true;
+    }
+
+    switch (table_entry_size(m, n)) {
+    case sizeof (unsigned char):
+        return SYMBOL_NAME(lcs_table_8)(options, x, m, y, n, result, length);
+    case sizeof (unsigned short):
+        return SYMBOL_NAME(lcs_table_16)(options, x, m, y, n, result, length);
+    case sizeof (uint32_t):
+        return SYMBOL_NAME(lcs_table_32)(options, x, m, y, n, result, length);
+    default:
+        return false;
+    }
+}
+
+/* lcs_banded
+ *
+ * Same arguments as lcs_table() but only fills a band of diagonals around the
+ * one from the top left to the bottom right corner.  The band starts narrow
+ * and doubles in width until the LCS found in it can be proven to be a longest
+ * one.  That takes O((m + n) D) time and memory where D is the number of
+ * inserts and deletes between the two strings.
+ *
+ * The length of the result goes in *length.  Returns false without writing the
+ * result if the band would need more than max_bytes.
+ */
+static bool
+SYMBOL_NAME(lcs_banded)(const struct textile_options *options,
+                        const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                        size_t max_bytes, struct textile_match *result,
+                        size_t *length)
+{
+    size_t entry = 2 * table_entry_size(m, n);
+
+    if (! (x && m && y && n && result && entry)) {
+        *length = 0;
+        return true;
+    }
+
+    switch (entry / 2) {
+    case sizeof (unsigned char):
+        return SYMBOL_NAME(lcs_banded_8)(options, x, m, y, n,
+                max_bytes / entry, result, length);
+    case sizeof (unsigned short):
+        return SYMBOL_NAME(lcs_banded_16)(options, x, m, y, n,
+                max_bytes / entry, result, length);
+    default:
+        return SYMBOL_NAME(lcs_banded_32)(options, x, m, y, n,
+                max_bytes / entry, result, length);
+    }
+}
+
+/*
+ * Collects an LCS piece by piece for the engines that work on sub-problems.
+ * Pieces must be appended in order.
+ */
+struct SYMBOL_NAME(lcs_builder) {
+    const struct textile_options *options;
+    const SYMBOL *x;
+    const SYMBOL *y;
+
+    struct textile_match *result;
+    size_t length;
+};
+
+static void
+SYMBOL_NAME(lcs_append)(struct SYMBOL_NAME(lcs_builder) *b, size_t i, size_t j)
+{
+    struct textile_match *entry = &b->result[b->length++];
+
+    entry->i = i;
+    entry->j = j;
+}
+
+/*
+ * Solves x[i..i+m) against y[j..j+n) with lcs_table() and appends the result.
+ * The engines below hand their sub-problems over once they are small enough so
+ * that the pieces still get the best grouping the table can find.  Returns
+ * false, appending nothing, if memory for the table runs out.  The engines
+ * then keep splitting the piece themselves.
+ */
+static bool
+SYMBOL_NAME(lcs_append_table)(struct SYMBOL_NAME(lcs_builder) *b,
+                              size_t i, size_t m, size_t j, size_t n)
+{
+    size_t k, length = 0;
+
+    if (!SYMBOL_NAME(lcs_table)(b->options,
+                b->x + i, m, b->y + j, n, b->result + b->length, &length))
+        return false;
+
+    for (k = b->length; k != b->length + length; ++k) {
+        b->result[k].i += i;
+        b->result[k].j += j;
+    }
+    b->length += length;
+
+    return true;
+}
+
+/*
+ * These are built on the bit-parallel rows which have a mask for each of the
+ * 256 bytes.
+ */
+#ifdef SYMBOL_BYTES
+
+struct SYMBOL_NAME(hirschberg) {
+    struct SYMBOL_NAME(lcs_builder) out;
+
+    /* Scratch rows, each long enough for the whole of y plus one. */
+    size_t *forward;
+    size_t *backward;
+
+    struct bit_rows rows;
+    bool failed;
+};
+
+/*
+ * Finds the LCS of x[i..i+m) and y[j..j+n) and appends it to the result.
+ *
+ * x is cut in half.  The forward row from the top half and the backward row
+ * from the bottom half tell where an LCS crosses the cut in y.  Each side of
+ * the crossing point is then solved independently.
+ */
+static void
+SYMBOL_NAME(hirschberg)(struct SYMBOL_NAME(hirschberg) *h,
+                        size_t i, size_t m, size_t j, size_t n)
+{
+    const SYMBOL *x = h->out.x, *y = h->out.y, *match;
+    size_t k, best, split, mid;
+
+    if (!m || !n)
+        return;
+
+    if (table_fits(h->out.options, m, n)
+            && SYMBOL_NAME(lcs_append_table)(&h->out, i, m, j, n))
+        return;
+
+    if (m == 1) {
+        match = memchr(y + j, x[i], n);
+        if (match)
+            SYMBOL_NAME(lcs_append)(&h->out, i, match - y);
+        return;
+    }
+
+    mid = m / 2;
+    if (!lcs_row_forward(&h->rows, x + i, mid, y + j, n, h->forward)
+            || !lcs_row_backward(&h->rows,
+                x + i + mid, m - mid, y + j, n, h->backward)) {
+        h->failed = true;
+        return;
+    }
+
+    best = 0;
+    split = 0;
+    for (k = 0; k <= n; ++k) {
+        if (h->forward[k] + h->backward[k] > best) {
+            best = h->forward[k] + h->backward[k];
+            split = k;
+        }
+    }
+
+    SYMBOL_NAME(hirschberg)(h, i, mid, j, split);
+    SYMBOL_NAME(hirschberg)(h, i + mid, m - mid, j + split, n - split);
+}
+
+/* lcs_linear
+ *
+ * Same contract as lcs_table() but uses Hirschberg's divide and conquer
+ * algorithm.  Memory is O(m + n) beyond what the small sub-problems handed to
+ * lcs_table() use.  The rows that locate each split are computed with the
+ * bit-parallel algorithm so the repeated passes over the input stay cheap.
+ */
+static bool
+SYMBOL_NAME(lcs_linear)(const struct textile_options *options,
+                        const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                        struct textile_match *result, size_t *length)
+{
+    struct SYMBOL_NAME(hirschberg) h = {
+        .out = {
+            .options = options,
+            .x = x, .y = y, .result = result, .length = 0
+        }
+    };
+
+    h.rows.bits.ctx = options->ctx;
+    h.forward = ctx_alloc(options->ctx, 2 * (n + 1) * sizeof (size_t));
+    h.rows.v = ctx_alloc(options->ctx, bit_words(n) * sizeof (uint64_t));
+    if (h.forward && h.rows.v) {
+        h.backward = h.forward + n + 1;
+        SYMBOL_NAME(hirschberg)(&h, 0, m, 0, n);
+    } else {
+        h.failed = true;
+    }
+
+    bit_masks_free(&h.rows.bits);
+    ctx_free(options->ctx, h.rows.v);
+    ctx_free(options->ctx, h.forward);
+
+    *length = h.out.length;
+
+    return !h.failed;
+}
+
+/*
+ * Moves isolated matches next to a neighbouring match where an equal pair of
+ * characters allows it.  Engines that don't track grouping tend to scatter
+ * single matches about.  The length of the LCS is unchanged.
+ */
+static void
+SYMBOL_NAME(lcs_regroup)(const SYMBOL *x, const SYMBOL *y,
+                         struct textile_match *lcs, size_t length)
+{
+    struct textile_match *entry;
+    size_t k, i, j;
+
+    for (k = 0; k != length; ++k) {
+        entry = &lcs[k];
+
+        if (k && entry[-1].i + 1 == entry->i && entry[-1].j + 1 == entry->j)
+            continue;
+        if (k + 1 != length
+                && entry->i + 1 == entry[1].i && entry->j + 1 == entry[1].j)
+            continue;
+
+        if (k) {
+            /* Join the previous match.  That can't pass the next one. */
+            i = entry[-1].i + 1;
+            j = entry[-1].j + 1;
+            if (x[i]==y[j]) {
+                entry->i = i;
+                entry->j = j;
+                continue;
+            }
+        }
+
+        if (k + 1 != length) {
+            /* Join the next match if that doesn't pass the previous one. */
+            i = entry[1].i - 1;
+            j = entry[1].j - 1;
+            if (x[i]==y[j] && (!k || (entry[-1].i < i && entry[-1].j < j))) {
+                entry->i = i;
+                entry->j = j;
+            }
+        }
+    }
+}
+
+/* lcs_bits
+ *
+ * Same contract as lcs_table() but keeps only the bit-parallel row vectors.
+ * That is one bit per cell instead of a whole c table entry.  The
+ * vectors run along x, reversed, and there is one for each suffix of y.
+ *
+ * Walking from the start, a pair of equal characters is always part of an LCS
+ * of what's left.  Otherwise, a set bit for x[i] in the row for y[j..n) says
+ * that skipping x[i] doesn't shorten the LCS.  So the traceback is a single
+ * bit test per step.
+ *
+ * The result doesn't have the grouping of lcs_table().  lcs_regroup() recovers
+ * some of it afterwards.
+ */
+static bool
+SYMBOL_NAME(lcs_bits)(const struct textile_options *options,
+                      const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                      struct textile_match *result, size_t *length)
+{
+    struct bit_masks bits = {
+        .masks = NULL, .slots = 0, .words = 0, .ctx = options->ctx
+    };
+    struct SYMBOL_NAME(lcs_builder) out = {
+        .options = options,
+        .x = x, .y = y, .result = result, .length = 0
+    };
+    const struct bit_masks *masks = index_bits(options->index, x, m);
+    uint64_t *rows, *v;
+    size_t i, j, words = bit_words(m);
+
+    rows = ctx_alloc(options->ctx, (n + 1) * words * sizeof *rows);
+    if (!masks && rows && bit_masks_build(&bits, x, m, true))
+        masks = &bits;
+    if (!rows || !masks) {
+        ctx_free(options->ctx, rows);
+        bit_masks_free(&bits);
+        return false;
+    }
+
+    /* The row for y[j..n) is at rows + j * words. */
+    v = rows + n * words;
+    memset(v, 0xff, words * sizeof *v);
+    for (j = n; j != 0; --j) {
+        memcpy(v - words, v, words * sizeof *v);
+        v -= words;
+        bit_step(masks, v, y[j-1]);
+    }
+
+    for (i = 0, j = 0; i != m && j != n; ) {
+        if (x[i]==y[j])
+            SYMBOL_NAME(lcs_append)(&out, i++, j++);
+        else if (bit_test(rows + j * words, m - 1 - i))
+            i++;
+        else
+            j++;
+    }
+
+    bit_masks_free(&bits);
+    ctx_free(options->ctx, rows);
+
+    SYMBOL_NAME(lcs_regroup)(x, y, result, out.length);
+    *length = out.length;
+
+    return true;
+}
+
+#endif
+
+struct SYMBOL_NAME(myers) {
+    struct SYMBOL_NAME(lcs_builder) out;
+
+    /*
+     * Furthest reaching x on each diagonal k = x - y for the forward and the
+     * backward search.  Indexed from -(m + n + 1) to m + n + 1 through the
+     * offset pointers below.
+     */
+    ptrdiff_t *forward;
+    ptrdiff_t *backward;
+};
+
+/*
+ * Searches forward from the start and backward from the end of x and y at the
+ * same time until the two meet.  That takes D / 2 rounds where D is the number
+ * of inserts and deletes between the two.  This is the middle snake from
+ * "An O(ND) Difference Algorithm and Its Variations" by Eugene W. Myers.
+ *
+ * Returns D and sets (*xmid, *ymid) to a point on a shortest edit path.  Each
+ * side of that point needs fewer than D edits.  Gives up and returns -1 if the
+ * search goes beyond limit rounds.
+ *
+ * The first and last characters of x and y must differ.
+ */
+static ptrdiff_t
+SYMBOL_NAME(myers_split)(struct SYMBOL_NAME(myers) *s,
+                         size_t i, size_t m, size_t j, size_t n,
+                         ptrdiff_t limit,
+                         size_t *xmid, size_t *ymid)
+{
+    const SYMBOL *x = s->out.x + i, *y = s->out.y + j;
+    ptrdiff_t M = m, N = n, delta = M - N;
+    ptrdiff_t *vf = s->forward, *vb = s->backward;
+    ptrdiff_t d, k, r, xx, yy;
+    bool odd = delta & 1;
+
+    /*
+     * Diagonals outside of -N..M are never entered.  Unreached diagonals read
+     * as -1 going forward and as past the end going backward.
+     */
+    for (k = -N - 1; k <= M + 1; ++k) {
+        vf[k] = -1;
+        vb[k] = M + N + 2;
+    }
+
+    for (d = 0; d <= limit; ++d) {
+        for (k = -d; k <= d; k += 2) {
+            if (k < -N || k > M)
+                continue;
+
+            if (d == 0) {
+                xx = 0;
+            } else {
+                /* Down from diagonal k + 1 or right from k - 1. */
+                xx = -1;
+                if (vf[k+1] >= 0 && vf[k+1] - k <= N)
+                    xx = vf[k+1];
+                if (vf[k-1] >= 0 && vf[k-1] + 1 <= M)
+                    xx = (vf[k-1] + 1 > xx) ? vf[k-1] + 1 : xx;
+                if (xx < 0)
+                    continue;
+            }
+
+            for (yy = xx - k; xx < M && yy < N && x[xx]==y[yy]; ++xx, ++yy)
+                ;
+            vf[k] = xx;
+
+            if (odd && k >= delta - (d - 1) && k <= delta + (d - 1)
+                    && xx >= vb[k]) {
+                *xmid = xx;
+                *ymid = yy;
+                return 2 * d - 1;
+            }
+        }
+
+        for (r = -d; r <= d; r += 2) {
+            k = r + delta;
+            if (k < -N || k > M)
+                continue;
+
+            if (d == 0) {
+                xx = M;
+            } else {
+                /* Left from diagonal k + 1 or up from k - 1. */
+                xx = M + N + 2;
+                if (vb[k+1] <= M && vb[k+1] - 1 >= 0)
+                    xx = vb[k+1] - 1;
+                if (vb[k-1] <= M && vb[k-1] - k >= 0)
+                    xx = (vb[k-1] < xx) ? vb[k-1] : xx;
+                if (xx > M)
+                    continue;
+            }
+
+            for (yy = xx - k; xx > 0 && yy > 0 && x[xx-1]==y[yy-1]; --xx, --yy)
+                ;
+            vb[k] = xx;
+
+            if (!odd && k >= -d && k <= d && vf[k] >= 0 && xx <= vf[k]) {
+                *xmid = xx;
+                *ymid = yy;
+                return 2 * d;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Finds the LCS of x[i..i+m) and y[j..j+n) and appends it to the result.
+ *
+ * The common prefix and suffix are matched directly.  What is left is split at
+ * the middle snake and each side is solved recursively.  Only the top level
+ * call is bounded by limit since every split needs fewer edits.  Returns false
+ * if that bound was hit.
+ */
+static bool
+SYMBOL_NAME(myers)(struct SYMBOL_NAME(myers) *s,
+                   size_t i, size_t m, size_t j, size_t n, ptrdiff_t limit)
+{
+    const SYMBOL *x = s->out.x, *y = s->out.y;
+    size_t suffix, k, xmid, ymid;
+
+    for ( ; m && n && x[i]==y[j]; ++i, ++j, --m, --n)
+        SYMBOL_NAME(lcs_append)(&s->out, i, j);
+
+    for (suffix = 0; suffix != m && suffix != n
+            && x[i+m-suffix-1]==y[j+n-suffix-1]; ++suffix)
+        ;
+    m -= suffix;
+    n -= suffix;
+
+    if (m && n && !(table_fits(s->out.options, m, n)
+                && SYMBOL_NAME(lcs_append_table)(&s->out, i, m, j, n))) {
+        if (SYMBOL_NAME(myers_split)(s, i, m, j, n, limit, &xmid, &ymid) < 0)
+            return false;
+
+        SYMBOL_NAME(myers)(s, i, xmid, j, ymid, PTRDIFF_MAX);
+        SYMBOL_NAME(myers)(s, i + xmid, m - xmid, j + ymid, n - ymid,
+                PTRDIFF_MAX);
+    }
+
+    for (k = 0; k != suffix; ++k)
+        SYMBOL_NAME(lcs_append)(&s->out, i + m + k, j + n + k);
+
+    return true;
+}
+
+/* lcs_myers
+ *
+ * Same contract as lcs_table() but uses Myers' O((m + n) D) algorithm with the
+ * linear space refinement.  It is very fast when x and y are nearly the same.
+ *
+ * limit bounds the number of rounds spent looking for the first split which
+ * is about half the number of edits.  Returns false without a result if it
+ * was not enough or if memory runs out.
+ */
+static bool
+SYMBOL_NAME(lcs_myers)(const struct textile_options *options,
+                       const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                       ptrdiff_t limit,
+                       struct textile_match *result, size_t *length)
+{
+    struct SYMBOL_NAME(myers) s = {
+        .out = {
+            .options = options,
+            .x = x, .y = y, .result = result, .length = 0
+        }
+    };
+    size_t diagonals = 2 * (m + n) + 3;
+    bool found;
+
+    s.forward = ctx_alloc(options->ctx, 2 * diagonals * sizeof (ptrdiff_t));
+    if (!s.forward)
+        return false;
+    s.backward = s.forward + diagonals;
+
+    /* Let diagonals be indexed from -(m + n + 1). */
+    s.forward += m + n + 1;
+    s.backward += m + n + 1;
+
+    found = SYMBOL_NAME(myers)(&s, 0, m, 0, n, limit);
+    *length = s.out.length;
+
+    ctx_free(options->ctx, s.forward - (m + n + 1));
+
+    return found;
+}
+
+/*
+ * Fills in the line of a that starts at begin.  It ends after the next
+ * SYMBOL_NEWLINE or at end, whichever comes first.
+ */
+static void
+SYMBOL_NAME(line_make)(const SYMBOL *a, size_t begin, size_t end,
+                       struct line *line)
+{
+    size_t k;
+    uint64_t hash;
+
+    /* FNV-1a */
+    hash = 14695981039346656037ULL;
+    for (k = begin; k != end; ) {
+        hash = (hash ^ (uint64_t)a[k]) * 1099511628211ULL;
+        if (a[k++] == SYMBOL_NEWLINE)
+            break;
+    }
+
+    line->begin = begin;
+    line->len = k - begin;
+    line->hash = hash;
+}
+
+/*
+ * Cuts a into lines, each ending after a SYMBOL_NEWLINE or at the end.  The
+ * lines are allocated from ctx.  Returns the number of lines or zero if memory
+ * runs out.
+ */
+static size_t
+SYMBOL_NAME(lines_split)(struct textile_ctx *ctx,
+                         const SYMBOL *a, size_t len, struct line **lines)
+{
+    size_t count = 0, begin;
+
+#ifdef SYMBOL_BYTES
+    const char *end;
+
+    for (end = a; (end = memchr(end, '\n', a + len - end)); ++end)
+        count++;
+#else
+    for (begin = 0; begin != len; ++begin)
+        count += a[begin] == SYMBOL_NEWLINE;
+#endif
+    if (!len || a[len-1] != SYMBOL_NEWLINE)
+        count++;
+
+    *lines = ctx_alloc(ctx, count * sizeof **lines);
+    if (!*lines)
+        return 0;
+
+    count = 0;
+    for (begin = 0; begin != len; begin += (*lines)[count++].len)
+        SYMBOL_NAME(line_make)(a, begin, len, &(*lines)[count]);
+
+    return count;
+}
+
+/*
+ * Looks up the line of a in the table.  The lines in the table are all lines
+ * of x.  If it isn't there, the line is added when insert is set and NULL is
+ * returned otherwise.
+ */
+static struct line_slot *
+SYMBOL_NAME(line_find)(struct line_slot *table, size_t mask, const SYMBOL *x,
+                       const SYMBOL *a, const struct line *line, bool insert)
+{
+    struct line_slot *slot;
+    size_t k;
+
+    for (k = line->hash & mask; ; k = (k + 1) & mask) {
+        slot = &table[k];
+        if (!slot->line) {
+            if (!insert)
+                return NULL;
+            slot->line = line;
+            return slot;
+        }
+        if (slot->line->hash == line->hash && slot->line->len == line->len
+                && !memcmp(x + slot->line->begin, a + line->begin,
+                    line->len * sizeof (SYMBOL)))
+            return slot;
+    }
+}
+
+/*
+ * Finds the anchors between the lines of x and the lines of y.  Stores the
+ * line numbers in y of the anchors at anchors[line number in x], with
+ * SIZE_MAX for lines that aren't anchors.  Returns the number of anchors or
+ * SIZE_MAX if memory runs out.
+ */
+static size_t
+SYMBOL_NAME(lines_anchor)(struct textile_ctx *ctx, const SYMBOL *x,
+                          const struct line *x_lines, size_t x_count,
+                          const SYMBOL *y,
+                          const struct line *y_lines, size_t y_count,
+                          size_t *anchors)
+{
+    struct line_slot *table, *slot;
+    size_t *piles, *previous, *pairs;
+    size_t size, k, p, lo, hi, mid, top, count = 0, found = 0;
+
+    for (size = 1; size < 2 * x_count; size <<= 1)
+        ;
+
+    table = ctx_calloc(ctx, size, sizeof *table);
+    pairs = ctx_alloc(ctx, 3 * x_count * sizeof *pairs);
+    if (!table || !pairs) {
+        ctx_free(ctx, table);
+        ctx_free(ctx, pairs);
+        return SIZE_MAX;
+    }
+    piles = pairs + x_count;
+    previous = piles + x_count;
+
+    for (k = 0; k != x_count; ++k) {
+        slot = SYMBOL_NAME(line_find)(table, size - 1, x, x, &x_lines[k], true);
+        slot->count[0]++;
+        slot->index[0] = k;
+        anchors[k] = SIZE_MAX;
+    }
+
+    /* Lines of y that are not in x can't be anchors and aren't counted. */
+    for (k = 0; k != y_count; ++k) {
+        slot = SYMBOL_NAME(line_find)(table, size - 1,
+                x, y, &y_lines[k], false);
+        if (slot) {
+            slot->count[1]++;
+            slot->index[1] = k;
+        }
+    }
+
+    /* Unique pairs in the order of x */
+    for (k = 0; k != size; ++k) {
+        slot = &table[k];
+        if (slot->line && slot->count[0] == 1 && slot->count[1] == 1)
+            anchors[slot->index[0]] = slot->index[1];
+    }
+    for (k = 0; k != x_count; ++k)
+        if (anchors[k] != SIZE_MAX)
+            pairs[count++] = k;
+
+    /*
+     * Patience sorting.  piles[p] is the pair on top of pile p and each pair
+     * remembers the top of the pile to its left when it was placed.
+     */
+    for (k = 0; k != count; ++k) {
+        lo = 0;
+        hi = found;
+        while (lo != hi) {
+            mid = (lo + hi) / 2;
+            if (anchors[pairs[piles[mid]]] < anchors[pairs[k]])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        previous[k] = lo ? piles[lo - 1] : SIZE_MAX;
+        piles[lo] = k;
+        if (lo == found)
+            found++;
+    }
+
+    /* Keep only the pairs on the longest chain, listed in piles. */
+    top = found ? piles[found - 1] : SIZE_MAX;
+    for (k = top, p = found; k != SIZE_MAX; k = previous[k])
+        piles[--p] = pairs[k];
+    for (k = 0, p = 0; k != count; ++k) {
+        if (p != found && piles[p] == pairs[k])
+            p++;
+        else
+            anchors[pairs[k]] = SIZE_MAX;
+    }
+
+    ctx_free(ctx, pairs);
+    ctx_free(ctx, table);
+
+    return found;
+}
+
+static size_t
+SYMBOL_NAME(lcs)(const struct textile_options *options,
+                 const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                 struct textile_match *result);
+
+/*
+ * Solves x[i..i+m) against y[j..j+n) with lcs() and appends the result.
+ */
+static void
+SYMBOL_NAME(lcs_append_gap)(struct SYMBOL_NAME(lcs_builder) *b,
+                            size_t i, size_t m, size_t j, size_t n)
+{
+    size_t k, length;
+
+    length = SYMBOL_NAME(lcs)(b->options,
+            b->x + i, m, b->y + j, n, b->result + b->length);
+    for (k = b->length; k != b->length + length; ++k) {
+        b->result[k].i += i;
+        b->result[k].j += j;
+    }
+    b->length += length;
+}
+
+/* lcs_anchored
+ *
+ * Same arguments as lcs_table() but anchors on unique lines first and solves
+ * the gaps with lcs().  The length of the result goes in *length.  Returns
+ * false without writing the result if no anchors are found.
+ */
+static bool
+SYMBOL_NAME(lcs_anchored)(const struct textile_options *options,
+                          const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                          struct textile_match *result, size_t *length)
+{
+    struct SYMBOL_NAME(lcs_builder) out = {
+        .options = options,
+        .x = x, .y = y, .result = result, .length = 0
+    };
+    struct textile_ctx *ctx = options->ctx;
+    struct line *x_lines = NULL, *y_lines = NULL, *spans = NULL;
+    size_t *anchors = NULL;
+    size_t x_count, y_count, found = 0, k, c, i, j;
+
+#ifdef SYMBOL_BYTES
+    if (index_covers(options->index, x, m))
+        x_count = index_lines(ctx, options->index, x, m, &x_lines);
+    else
+#endif
+        x_count = SYMBOL_NAME(lines_split)(ctx, x, m, &x_lines);
+    y_count = SYMBOL_NAME(lines_split)(ctx, y, n, &y_lines);
+    if (x_count && y_count)
+        anchors = ctx_alloc(ctx, x_count * sizeof *anchors);
+    if (anchors)
+        found = SYMBOL_NAME(lines_anchor)(ctx, x, x_lines, x_count,
+                y, y_lines, y_count, anchors);
+    if (found && found != SIZE_MAX)
+        spans = ctx_alloc(ctx, 2 * found * sizeof *spans);
+
+    /*
+     * Pairs of anchor lines are kept as the line in x followed by the line in
+     * y so that the rest can be freed before solving the gaps.
+     */
+    for (k = 0, c = 0; spans && k != x_count; ++k) {
+        if (anchors[k] != SIZE_MAX) {
+            spans[c++] = x_lines[k];
+            spans[c++] = y_lines[anchors[k]];
+        }
+    }
+
+    ctx_free(ctx, anchors);
+    ctx_free(ctx, y_lines);
+    ctx_free(ctx, x_lines);
+    if (!spans)
+        return false;
+
+    for (k = 0, i = 0, j = 0; k != 2 * found; k += 2) {
+        SYMBOL_NAME(lcs_append_gap)(&out,
+                i, spans[k].begin - i, j, spans[k+1].begin - j);
+
+        for (c = 0; c != spans[k].len; ++c)
+            SYMBOL_NAME(lcs_append)(&out,
+                    spans[k].begin + c, spans[k+1].begin + c);
+
+        i = spans[k].begin + spans[k].len;
+        j = spans[k+1].begin + spans[k+1].len;
+    }
+    SYMBOL_NAME(lcs_append_gap)(&out, i, m - i, j, n - j);
+
+    ctx_free(ctx, spans);
+    *length = out.length;
+
+    return true;
+}
+
+/* lcs
+ *
+ * Computes the longest common substring of the two strings passed.  Takes the
+ * same arguments as lcs_table() plus the caller's options and returns the
+ * length of the result.
+ *
+ * Unless the options ask for a particular engine, the problem is first cut up
+ * at unique lines with lcs_anchored(), which comes back here for each of the
+ * gaps.  Without anchors, small problems get the full table.  Anything bigger
+ * than the memory budget tries lcs_banded() with the same limit on memory,
+ * which finds the best LCS when the two are close.  Otherwise lcs_myers() gets
+ * a try with a bounded number of edits.  If that fails too, lcs_bits() is used
+ * as long as its row vectors fit the budget.  Past that, it goes through
+ * lcs_linear() so that memory stays proportional to the input.
+ *
+ * An engine that runs out of memory hands the problem on to the next one down
+ * the same list, whether it was picked here or by the options.  Only when
+ * memory for the last one runs out too does the result come back empty.
+ *
+ * The bit-parallel engines need the bytes of the text.  Other symbols skip
+ * them and finish with lcs_myers() without a limit.  An explicit
+ * TEXTILE_ENGINE_LINEAR or TEXTILE_ENGINE_BITS is taken as AUTO.
+ */
+static size_t
+SYMBOL_NAME(lcs)(const struct textile_options *options,
+                 const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                 struct textile_match *result)
+{
+    size_t length;
+
+    if (! (x && m && y && n && result)) {
+        return 0;
+    }
+
+    switch (options->engine) {
+    case TEXTILE_ENGINE_TABLE:
+        if (SYMBOL_NAME(lcs_table)(options, x, m, y, n, result, &length))
+            return engine_used(options, TEXTILE_ENGINE_TABLE, length);
+        break;
+
+#ifdef SYMBOL_BYTES
+    case TEXTILE_ENGINE_LINEAR:
+        if (SYMBOL_NAME(lcs_linear)(options, x, m, y, n, result, &length))
+            return engine_used(options, TEXTILE_ENGINE_LINEAR, length);
+        break;
+
+    case TEXTILE_ENGINE_BITS:
+        if (SYMBOL_NAME(lcs_bits)(options, x, m, y, n, result, &length))
+            return engine_used(options, TEXTILE_ENGINE_BITS, length);
+        break;
+#endif
+
+    case TEXTILE_ENGINE_MYERS:
+        if (SYMBOL_NAME(lcs_myers)(options, x, m, y, n, PTRDIFF_MAX,
+                    result, &length))
+            return engine_used(options, TEXTILE_ENGINE_MYERS, length);
+        break;
+
+    case TEXTILE_ENGINE_BANDED:
+        if (SYMBOL_NAME(lcs_banded)(options, x, m, y, n, SIZE_MAX,
+                    result, &length))
+            return engine_used(options, TEXTILE_ENGINE_BANDED, length);
+        break;
+
+    case TEXTILE_ENGINE_AUTO:
+    default:
+        break;
+    }
+
+    if (SYMBOL_NAME(lcs_anchored)(options, x, m, y, n, result, &length))
+        return length;
+
+    if (table_fits(options, m, n)
+            && SYMBOL_NAME(lcs_table)(options, x, m, y, n, result, &length))
+        return engine_used(options, TEXTILE_ENGINE_TABLE, length);
+
+    if (SYMBOL_NAME(lcs_banded)(options, x, m, y, n, memory_budget(options),
+                result, &length))
+        return engine_used(options, TEXTILE_ENGINE_BANDED, length);
+
+    if (SYMBOL_NAME(lcs_myers)(options, x, m, y, n, myers_limit(m, n),
+                result, &length))
+        return engine_used(options, TEXTILE_ENGINE_MYERS, length);
+
+#ifdef SYMBOL_BYTES
+    if (bits_fit(options, m, n)
+            && SYMBOL_NAME(lcs_bits)(options, x, m, y, n, result, &length))
+        return engine_used(options, TEXTILE_ENGINE_BITS, length);
+
+    if (SYMBOL_NAME(lcs_linear)(options, x, m, y, n, result, &length))
+        return engine_used(options, TEXTILE_ENGINE_LINEAR, length);
+
+    return 0;
+#else
+    /*
+     * Without the bit-parallel rows, Myers' algorithm is the one that stays
+     * linear in memory however many edits it takes.
+     */
+    if (SYMBOL_NAME(lcs_myers)(options, x, m, y, n, PTRDIFF_MAX,
+                result, &length))
+        return engine_used(options, TEXTILE_ENGINE_MYERS, length);
+
+    return 0;
+#endif
+}
+
+#ifdef HAVE_VECTORS
+
+#define SYMBOL_LANES (VECTOR_BYTES / sizeof (SYMBOL))
+
+typedef SYMBOL SYMBOL_NAME(vec_symbols)
+    __attribute__((vector_size(VECTOR_BYTES)));
+
+#endif
+
+/*
+ * Returns the length of the longest prefix shared by all three strings, each
+ * at least len long.  Compares a vector's worth at a time until the first
+ * difference.
+ */
+static size_t
+SYMBOL_NAME(common_prefix)(const SYMBOL *a, const SYMBOL *b, const SYMBOL *c,
+                           size_t len)
+{
+    size_t k = 0;
+
+#ifdef HAVE_VECTORS
+    SYMBOL_NAME(vec_symbols) va, vb, vc;
+    vec_u64 diff;
+
+    for ( ; k + SYMBOL_LANES <= len; k += SYMBOL_LANES) {
+        memcpy(&va, a + k, sizeof va);
+        memcpy(&vb, b + k, sizeof vb);
+        memcpy(&vc, c + k, sizeof vc);
+        diff = (vec_u64)((va ^ vb) | (va ^ vc));
+        if (diff[0] | diff[1] | diff[2] | diff[3])
+            break;
+    }
+#endif
+
+    while (k != len && a[k] == b[k] && a[k] == c[k])
+        ++k;
+
+    return k;
+}
+
+/*
+ * Like common_prefix() but for the suffix shared by the len characters
+ * before a, b and c.
+ */
+static size_t
+SYMBOL_NAME(common_suffix)(const SYMBOL *a, const SYMBOL *b, const SYMBOL *c,
+                           size_t len)
+{
+    size_t k = 0;
+
+#ifdef HAVE_VECTORS
+    SYMBOL_NAME(vec_symbols) va, vb, vc;
+    vec_u64 diff;
+
+    for ( ; k + SYMBOL_LANES <= len; k += SYMBOL_LANES) {
+        memcpy(&va, a - k - SYMBOL_LANES, sizeof va);
+        memcpy(&vb, b - k - SYMBOL_LANES, sizeof vb);
+        memcpy(&vc, c - k - SYMBOL_LANES, sizeof vc);
+        diff = (vec_u64)((va ^ vb) | (va ^ vc));
+        if (diff[0] | diff[1] | diff[2] | diff[3])
+            break;
+    }
+#endif
+
+    while (k != len && a[-k-1] == b[-k-1] && a[-k-1] == c[-k-1])
+        ++k;
+
+    return k;
+}
+
+#ifdef HAVE_VECTORS
+#undef SYMBOL_LANES
+#endif
+
+/*
+ * Allocates out and fills it with the LCS of x and y.  Leaves it empty if
+ * memory runs out.
+ */
+static void
+SYMBOL_NAME(lcs_string_compute)(const struct textile_options *options,
+                                const SYMBOL *x, size_t m,
+                                const SYMBOL *y, size_t n,
+                                struct textile_lcs *out)
+{
+    out->len = max(m, n);
+    out->matches = scratch_alloc(options->ctx,
+            out->len * sizeof (struct textile_match));
+    if (out->matches) {
+        out->len = SYMBOL_NAME(lcs)(options, x, m, y, n, out->matches);
+    } else {
+        out->len = 0;
+    }
+}
+
+/*
+ * An lcs_string_compute() call handed to another thread.  done is set under
+ * lock once out is filled.
+ */
+struct SYMBOL_NAME(lcs_job) {
+    const struct textile_options *options;
+    const SYMBOL *x;
+    size_t m;
+    const SYMBOL *y;
+    size_t n;
+    struct textile_lcs *out;
+
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    bool done;
+};
+
+static void
+SYMBOL_NAME(lcs_job_run)(void *arg)
+{
+    struct SYMBOL_NAME(lcs_job) *job = arg;
+
+    SYMBOL_NAME(lcs_string_compute)(job->options,
+            job->x, job->m, job->y, job->n, job->out);
+
+    pthread_mutex_lock(&job->lock);
+    job->done = true;
+    pthread_cond_signal(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *
+SYMBOL_NAME(lcs_job_thread)(void *arg)
+{
+    SYMBOL_NAME(lcs_job_run)(arg);
+    return NULL;
+}
+
+
+/*
+ * Computes the LCS of base with theirs into src and with ours into dest.  The
+ * first one runs on the side if the options ask for it.
+ */
+static void
+SYMBOL_NAME(lcs_both)(
+        const SYMBOL *base, size_t base_len,
+        const SYMBOL *ours, size_t ours_len,
+        const SYMBOL *theirs, size_t theirs_len,
+        struct textile_lcs *src, struct textile_lcs *dest,
+        const struct textile_options *options)
+{
+    struct SYMBOL_NAME(lcs_job) job = {
+        .options = options,
+        .x = base, .m = base_len, .y = theirs, .n = theirs_len,
+        .out = src,
+        .done = false
+    };
+    pthread_t thread;
+    bool started = false, threaded = false;
+
+    /* Compute LCS between base and theirs, on the side if asked to. */
+    if (options->flags & TEXTILE_CONCURRENT) {
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.finished, NULL);
+
+        if (options->submit) {
+            started = !options->submit(options->executor_data,
+                    SYMBOL_NAME(lcs_job_run), &job);
+        } else {
+            started = threaded = !pthread_create(&thread, NULL,
+                    SYMBOL_NAME(lcs_job_thread), &job);
+        }
+    }
+    if (!started)
+        SYMBOL_NAME(lcs_string_compute)(options, base, base_len,
+                theirs, theirs_len, src);
+
+    /* Compute LCS between base and ours. */
+    SYMBOL_NAME(lcs_string_compute)(options, base, base_len,
+                ours, ours_len, dest);
+
+    if (options->flags & TEXTILE_CONCURRENT) {
+        pthread_mutex_lock(&job.lock);
+        while (started && !job.done)
+            pthread_cond_wait(&job.finished, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+
+        if (threaded)
+            pthread_join(thread, NULL);
+
+        pthread_cond_destroy(&job.finished);
+        pthread_mutex_destroy(&job.lock);
+    }
+}
+
+#define WALK_SYMBOL SYMBOL
+#define WALK_NAME(name) SYMBOL_NAME(name)
+#include "textile_walk.h"
+#undef WALK_NAME
+#undef WALK_SYMBOL
+
+/*
+ * Hands the merge of a to out.  Returns true if conflicts occurred.
+ */
+static bool
+SYMBOL_NAME(merge_walk)(const struct textile_alignment *a,
+                        const struct merge_out *out)
+{
+    struct textile_walk walk;
+    struct textile_walk_step step;
+    bool conflicts_found = false;
+
+    if (a->prefix)
+        out_merged(out, MERGE_OURS, 0, a->prefix);
+
+    textile_walk_init(&walk, a);
+    while (SYMBOL_NAME(textile_walk_next)(&walk, a, &step)) {
+        if (out_step(out, &step, a->prefix))
+            conflicts_found = true;
+    }
+
+    if (a->suffix)
+        out_merged(out, MERGE_OURS, a->len[MERGE_OURS] - a->suffix,
+                a->len[MERGE_OURS]);
+
+    return conflicts_found;
+}
+
+/*
+ * Fills in a for base, ours and theirs once the fast paths of
+ * textile_merge_ex() are out of the way.  Whatever all three start and end
+ * with is merged as is and only the part in between is compared.
+ */
+static void
+SYMBOL_NAME(align_trimmed)(
+        struct textile_alignment *a,
+        const SYMBOL *base, size_t base_len,
+        const SYMBOL *ours, size_t ours_len,
+        const SYMBOL *theirs, size_t theirs_len,
+        const struct textile_options *options)
+{
+#ifdef SYMBOL_BYTES
+    struct textile_options indexed;
+    struct textile_index *index = NULL;
+#endif
+    size_t shortest, prefix, suffix, middle;
+
+    shortest = base_len;
+    if (ours_len < shortest)
+        shortest = ours_len;
+    if (theirs_len < shortest)
+        shortest = theirs_len;
+
+    prefix = SYMBOL_NAME(common_prefix)(base, ours, theirs, shortest);
+    suffix = SYMBOL_NAME(common_suffix)(base + base_len, ours + ours_len,
+            theirs + theirs_len, shortest - prefix);
+
+    /*
+     * Leave some of what is shared on each end of the middle.  Where a change
+     * sits next to symbols that repeat, the LCS can line it up with the ones
+     * before or after it, and the table breaks that tie looking at what lies
+     * on either side.  Cutting right at the change would move it and could
+     * turn a clean merge into a conflict or the other way around.  Only a run
+     * of repeats longer than TRIM_CONTEXT can still be lined up differently
+     * than without trimming.
+     */
+    prefix = (prefix > TRIM_CONTEXT) ? prefix - TRIM_CONTEXT : 0;
+    suffix = (suffix > TRIM_CONTEXT) ? suffix - TRIM_CONTEXT : 0;
+
+    middle = base_len - prefix - suffix;
+
+#ifdef SYMBOL_BYTES
+    /*
+     * Both sides are compared with the same base.  If that is going to take
+     * more than the table, index the base once for both.
+     */
+    if ((options->engine == TEXTILE_ENGINE_AUTO
+                || options->engine == TEXTILE_ENGINE_BITS)
+            && (!table_fits(options, middle, ours_len - prefix - suffix)
+                || !table_fits(options, middle, theirs_len - prefix - suffix))
+            && !index_covers(options->index, base + prefix, middle)) {
+        index = index_build(options->ctx, base + prefix, middle);
+        if (index) {
+            indexed = *options;
+            indexed.index = index;
+            options = &indexed;
+        }
+    }
+#endif
+
+    a->symbols[MERGE_BASE] = base;
+    a->symbols[MERGE_OURS] = ours;
+    a->symbols[MERGE_THEIRS] = theirs;
+    a->len[MERGE_BASE] = base_len;
+    a->len[MERGE_OURS] = ours_len;
+    a->len[MERGE_THEIRS] = theirs_len;
+    a->size = sizeof (SYMBOL);
+    a->prefix = prefix;
+    a->suffix = suffix;
+
+    SYMBOL_NAME(lcs_both)(
+            base + prefix, middle,
+            ours + prefix, ours_len - prefix - suffix,
+            theirs + prefix, theirs_len - prefix - suffix,
+            &a->src, &a->dest, options);
+
+#ifdef SYMBOL_BYTES
+    textile_index_free(index);
+#endif
+}
@@ -0,0 +1,601 @@
+/**
+ * © Copyright 2013 Carl N. Baldwin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The full table LCS engine.
+ *
+ * This file is included by lcs_merge.h once for each width of table entry.
+ * The c and g values never exceed the length of the shorter string so the
+ * narrowest type that can hold that is picked for each call.  Every loop over
+ * the table is compiled for that type rather than checking it cell by cell.
+ *
+ * The includer defines:
+ *
+ * ENTRY_TYPE - Unsigned type of the c and g fields.
+ * ENTRY_SIGNED - The signed type of the same width.
+ * ENTRY_NAME(name) - name with a suffix for the width and the type of symbol.
+ *
+ * The strings are made of SYMBOL as defined for lcs_merge.h.
+ */
+
+struct ENTRY_NAME(c_table_entry) {
+    ENTRY_TYPE c;
+    ENTRY_TYPE g;
+};
+
+struct ENTRY_NAME(c_table) {
+    struct ENTRY_NAME(c_table_entry) *table;
+    size_t m;
+    size_t n;
+
+    /* Number of tiles across the table or zero for the row-major layout. */
+    size_t tile_cols;
+
+    /*
+     * Only the diagonals j - i from band_lo on are stored, band_width of
+     * them in each row.  Cells outside of the band read as zero.  Zero width
+     * means the whole table is stored.
+     */
+    ptrdiff_t band_lo;
+    size_t band_width;
+};
+
+/*
+ * The table is accessed through these with banded known at compile time so
+ * that filling a full table pays nothing for the banded layout.  c_get() and
+ * c_set() work out the layout for themselves.
+ */
+static inline size_t
+ENTRY_NAME(c_index)(struct ENTRY_NAME(c_table) c, size_t i, size_t j,
+                    bool banded)
+{
+    if (banded)
+        return c.band_width*i + (j - i - c.band_lo);
+
+    if (!c.tile_cols)
+        return c.n*i + j;
+
+    return (((i >> C_TILE_SHIFT) * c.tile_cols + (j >> C_TILE_SHIFT))
+                << (2 * C_TILE_SHIFT))
+        | ((i & C_TILE_MASK) << C_TILE_SHIFT)
+        | (j & C_TILE_MASK);
+}
+
+static inline struct ENTRY_NAME(c_table_entry)
+ENTRY_NAME(c_load)(struct ENTRY_NAME(c_table) c, size_t i, size_t j,
+                   bool banded)
+{
+    static struct ENTRY_NAME(c_table_entry) zero = { .c = 0, .g = 0 };
+
+    if (i>=c.m || j>=c.n)
+        return zero;
+
+    if (banded && (size_t)(j - i - c.band_lo) >= c.band_width)
+        return zero;
+
+    return c.table[ENTRY_NAME(c_index)(c, i, j, banded)];
+}
+
+static inline void
+ENTRY_NAME(c_store)(struct ENTRY_NAME(c_table) c, size_t i, size_t j,
+                    struct ENTRY_NAME(c_table_entry) value, bool banded)
+{
+    c.table[ENTRY_NAME(c_index)(c, i, j, banded)] = value;
+}
+
+static inline struct ENTRY_NAME(c_table_entry)
+ENTRY_NAME(c_get)(struct ENTRY_NAME(c_table) c, size_t i, size_t j)
+{
+    return ENTRY_NAME(c_load)(c, i, j, c.band_width != 0);
+}
+
+static inline void
+ENTRY_NAME(c_set)(struct ENTRY_NAME(c_table) c, size_t i, size_t j,
+                  struct ENTRY_NAME(c_table_entry) value)
+{
+    ENTRY_NAME(c_store)(c, i, j, value, c.band_width != 0);
+}
+
+/*
+ * Allocates an m by n table from ctx, which may be NULL.  Returns false if
+ * memory runs out.  The table goes back with scratch_free().
+ */
+static bool
+ENTRY_NAME(c_table_alloc)(struct textile_ctx *ctx,
+                          struct ENTRY_NAME(c_table) *c,
+                          size_t m, size_t n, bool tiled)
+{
+    size_t entries = m * n;
+
+    c->m = m;
+    c->n = n;
+    c->tile_cols = 0;
+    c->band_lo = 0;
+    c->band_width = 0;
+    if (tiled) {
+        c->tile_cols = c_tiles(n);
+        entries = (c_tiles(m) * c->tile_cols) << (2 * C_TILE_SHIFT);
+    }
+
+    /* This can be quite large. */
+    c->table = scratch_alloc(ctx,
+            entries * sizeof (struct ENTRY_NAME(c_table_entry)));
+
+    return c->table != NULL;
+}
+
+static bool
+ENTRY_NAME(take_match)(struct ENTRY_NAME(c_table) c,
+           const SYMBOL *x, size_t i, size_t m,
+           const SYMBOL *y, size_t j, size_t n
+           ) {
+    struct ENTRY_NAME(c_table_entry) current, down, right, diagonal;
+
+    current = ENTRY_NAME(c_get)(c, i, j);
+    down = ENTRY_NAME(c_get)(c, i+1, j);
+    right = ENTRY_NAME(c_get)(c, i, j+1);
+
+    /* Take any opportunity to match sooner than later */
+    if (current.c > down.c && current.c > right.c) {
+        /* Can't find LCS without this match */
+        return true;
+    } else if (current.g > down.g && current.g > right.g) {
+        /* This match is the only way to find the best grouping. */
+        return true;
+    } else if (x[i]==y[j]) {
+        /* We don't need the match for LCS or best grouping */
+        /* Still, take the match if we can */
+        diagonal = ENTRY_NAME(c_get)(c, i+1, j+1);
+        if (current.g == diagonal.g) {
+            /* Won't hurt to take this match */
+            return true;
+        } else {
+            if (current.g == 1 + diagonal.g) {
+                /* Take the match only if it is not isolated. */
+                if (i && j && x[i-1]==y[j-1]) {
+                    /* This match groups with the previous match */
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Computes cell (i-1, j-1) of the c table from the cells below and to the
+ * right of it.  Based on pseudo-code from LCS-LENGTH(X,Y).
+ */
+static ALWAYS_INLINE void
+ENTRY_NAME(table_fill_cell)(struct ENTRY_NAME(c_table) c,
+                            const SYMBOL *x, const SYMBOL *y,
+                            size_t i, size_t j, bool banded)
+{
+    struct ENTRY_NAME(c_table_entry) c_entry, down, right, diagonal;
+    size_t m = c.m, n = c.n;
+
+    down = ENTRY_NAME(c_load)(c, i, j-1, banded);
+    right = ENTRY_NAME(c_load)(c, i-1, j, banded);
+    diagonal = ENTRY_NAME(c_load)(c, i, j, banded);
+
+    c_entry.c = (x[i-1]==y[j-1]) ? diagonal.c+1 : max(down.c, right.c);
+
+    c_entry.g = 0;
+    if (down.c == c_entry.c)
+        c_entry.g = down.g;
+
+    if (right.c == c_entry.c)
+        c_entry.g = max(right.g, c_entry.g);
+
+    if (x[i-1]==y[j-1]) {
+        c_entry.g = max(diagonal.g, c_entry.g);
+        if (i!=m && j!=n && x[i]==y[j]) {
+            c_entry.g = max(diagonal.g+1, c_entry.g);
+        }
+    }
+
+    ENTRY_NAME(c_store)(c, i-1, j-1, c_entry, banded);
+}
+
+/*
+ * Fills rows i_begin..i_end and columns j_begin..j_end (exclusive) of the c
+ * table row by row.  The cells below and to the right of the block must be
+ * filled already.
+ */
+static void
+ENTRY_NAME(table_fill_block)(struct ENTRY_NAME(c_table) c,
+                 const SYMBOL *x, const SYMBOL *y,
+                 size_t i_begin, size_t i_end, size_t j_begin, size_t j_end)
+{
+    size_t i, j;
+
+    /* Here's the O(mn).  Computes the c table from the book. */
+    for (i=i_end; i!=i_begin; --i) {
+        for (j=j_end; j!=j_begin; --j) {
+            ENTRY_NAME(table_fill_cell)(c, x, y, i, j, false);
+        }
+    }
+}
+
+/*
+ * Fills the cells of a banded table row by row.
+ */
+static void
+ENTRY_NAME(table_fill_band)(struct ENTRY_NAME(c_table) c,
+                            const SYMBOL *x, const SYMBOL *y)
+{
+    ptrdiff_t i, j, j_begin, j_end;
+
+    for (i = c.m; i != 0; --i) {
+        /* Cell (i-1, j-1) is on diagonal j - i. */
+        j_begin = i + c.band_lo;
+        j_end = j_begin + c.band_width;
+        if (j_begin < 1)
+            j_begin = 1;
+        if (j_end > (ptrdiff_t)c.n + 1)
+            j_end = c.n + 1;
+
+        for (j = j_end - 1; j >= j_begin; --j)
+            ENTRY_NAME(table_fill_cell)(c, x, y, i, j, true);
+    }
+}
+
+/*
+ * Fills rows i_begin..i_end of the table.  A tiled table is filled one tile at
+ * a time so that the cells being read and written stay in cache.
+ */
+static void
+ENTRY_NAME(table_fill_strip)(struct ENTRY_NAME(c_table) c,
+                             const SYMBOL *x, const SYMBOL *y,
+                             size_t i_begin, size_t i_end)
+{
+    size_t b, j_end;
+
+    if (!c.tile_cols) {
+        ENTRY_NAME(table_fill_block)(c, x, y, i_begin, i_end, 0, c.n);
+        return;
+    }
+
+    for (b = c.tile_cols; b != 0; --b) {
+        j_end = b << C_TILE_SHIFT;
+        ENTRY_NAME(table_fill_block)(c, x, y, i_begin, i_end,
+                (b - 1) << C_TILE_SHIFT, (j_end < c.n) ? j_end : c.n);
+    }
+}
+
+/*
+ * Fills the whole table.
+ */
+static void
+ENTRY_NAME(table_fill_rows)(struct ENTRY_NAME(c_table) c,
+                            const SYMBOL *x, const SYMBOL *y)
+{
+    size_t a, i_end;
+
+    if (!c.tile_cols) {
+        ENTRY_NAME(table_fill_block)(c, x, y, 0, c.m, 0, c.n);
+        return;
+    }
+
+    for (a = c_tiles(c.m); a != 0; --a) {
+        i_end = a << C_TILE_SHIFT;
+        ENTRY_NAME(table_fill_strip)(c, x, y,
+                (a - 1) << C_TILE_SHIFT, (i_end < c.m) ? i_end : c.m);
+    }
+}
+
+struct ENTRY_NAME(tile_fill) {
+    struct ENTRY_NAME(c_table) c;
+    const SYMBOL *x;
+    const SYMBOL *y;
+};
+
+/* Fills tile (a, b) for tiles_run(). */
+static void
+ENTRY_NAME(table_fill_tile)(void *data, size_t a, size_t b)
+{
+    struct ENTRY_NAME(tile_fill) *fill = data;
+    size_t i_end = (a + 1) * TILE_SIZE, j_end = (b + 1) * TILE_SIZE;
+
+    ENTRY_NAME(table_fill_block)(fill->c, fill->x, fill->y,
+            a * TILE_SIZE, (i_end < fill->c.m) ? i_end : fill->c.m,
+            b * TILE_SIZE, (j_end < fill->c.n) ? j_end : fill->c.n);
+}
+
+#ifdef HAVE_VECTORS
+
+#define ENTRY_LANES (VECTOR_BYTES / sizeof (ENTRY_TYPE))
+
+typedef SYMBOL_SIGNED ENTRY_NAME(vec_symbols)
+    __attribute__((vector_size(ENTRY_LANES * sizeof (SYMBOL))));
+typedef ENTRY_SIGNED ENTRY_NAME(vec_signed)
+    __attribute__((vector_size(VECTOR_BYTES)));
+typedef ENTRY_TYPE ENTRY_NAME(vec)
+    __attribute__((vector_size(VECTOR_BYTES)));
+
+/*
+ * One anti-diagonal of the c table worth of scratch space.  Entries are
+ * indexed by i and padded with a zero on either end plus a vector's worth at
+ * the end for loads that run past the last cell.
+ */
+struct ENTRY_NAME(diagonal) {
+    ENTRY_TYPE *c;
+    ENTRY_TYPE *g;
+    ENTRY_TYPE *eq;
+};
+
+/*
+ * Fills the c table one anti-diagonal at a time, starting from the bottom
+ * right corner.  Each cell depends only on the two diagonals after it so all
+ * of the cells on a diagonal are computed side by side in vector lanes.  The
+ * computation is the same as table_fill_rows(), step for step, so the table
+ * comes out identical.
+ *
+ * The three most recent diagonals are kept in small buffers where the
+ * neighbours of consecutive cells are also consecutive.  Zeros on either end
+ * stand in for the cells outside the table which c_get() handles with its
+ * bounds check.  y is reversed so that the characters to compare along a
+ * diagonal are consecutive as well.
+ *
+ * Returns false if the scratch space could not be allocated from ctx.
+ */
+TARGET_CLONES static bool
+ENTRY_NAME(table_fill_diagonals)(struct textile_ctx *ctx,
+                                 struct ENTRY_NAME(c_table) c,
+                                 const SYMBOL *x, const SYMBOL *y)
+{
+    size_t m = c.m, n = c.n, length = m + 2 + ENTRY_LANES;
+    size_t s, i, lo, hi, k;
+    struct ENTRY_NAME(diagonal) diagonals[3], current, next, after;
+    struct ENTRY_NAME(c_table_entry) entry;
+    ENTRY_TYPE *buffer;
+    SYMBOL *xs, *ys;
+    ENTRY_NAME(vec_symbols) xv, yv;
+    ENTRY_NAME(vec) eq, down_c, down_g, right_c, right_g, diag_c, diag_g;
+    ENTRY_NAME(vec) next_eq, c_v, g_v, one = (ENTRY_NAME(vec)){ 0 } + 1;
+
+    buffer = ctx_calloc(ctx, 9 * length, sizeof *buffer);
+    xs = ctx_alloc(ctx, (m + n + 2 * ENTRY_LANES) * sizeof *xs);
+    if (!buffer || !xs) {
+        ctx_free(ctx, buffer);
+        ctx_free(ctx, xs);
+        return false;
+    }
+
+    for (k = 0; k != 3; ++k) {
+        diagonals[k].c = buffer + (3 * k) * length + 1;
+        diagonals[k].g = buffer + (3 * k + 1) * length + 1;
+        diagonals[k].eq = buffer + (3 * k + 2) * length + 1;
+    }
+
+    memcpy(xs, x, m * sizeof *xs);
+    memset(xs + m, 0, ENTRY_LANES * sizeof *xs);
+    ys = xs + m + ENTRY_LANES;
+    for (k = 0; k != n; ++k)
+        ys[k] = y[n-1-k];
+    memset(ys + n, 0, ENTRY_LANES * sizeof *ys);
+
+    for (s = m + n - 1; s != 0; --s) {
+        /* Cells (i, s - 1 - i) for i in lo..hi */
+        current = diagonals[s % 3];
+        next = diagonals[(s + 1) % 3];
+        after = diagonals[(s + 2) % 3];
+
+        lo = (s > n) ? s - n : 0;
+        hi = (s - 1 < m - 1) ? s - 1 : m - 1;
+
+        for (i = lo; i <= hi; i += ENTRY_LANES) {
+            /* y[s - 1 - i] is ys[n - s + i] */
+            memcpy(&xv, xs + i, sizeof xv);
+            memcpy(&yv, ys + n - s + i, sizeof yv);
+            eq = (ENTRY_NAME(vec))__builtin_convertvector(xv == yv,
+                    ENTRY_NAME(vec_signed));
+
+            memcpy(&down_c, next.c + i + 1, sizeof down_c);
+            memcpy(&down_g, next.g + i + 1, sizeof down_g);
+            memcpy(&right_c, next.c + i, sizeof right_c);
+            memcpy(&right_g, next.g + i, sizeof right_g);
+            memcpy(&diag_c, after.c + i + 1, sizeof diag_c);
+            memcpy(&diag_g, after.g + i + 1, sizeof diag_g);
+            memcpy(&next_eq, after.eq + i + 1, sizeof next_eq);
+
+            c_v = (eq & (diag_c + one))
+                | (~eq & VEC_MAX(ENTRY_NAME(vec), down_c, right_c));
+
+            g_v = (ENTRY_NAME(vec))(down_c == c_v) & down_g;
+            g_v = VEC_MAX(ENTRY_NAME(vec), g_v,
+                    (ENTRY_NAME(vec))(right_c == c_v) & right_g);
+            g_v = VEC_MAX(ENTRY_NAME(vec), g_v, eq & diag_g);
+            g_v = VEC_MAX(ENTRY_NAME(vec), g_v,
+                    eq & next_eq & (diag_g + one));
+
+            memcpy(current.c + i, &c_v, sizeof c_v);
+            memcpy(current.g + i, &g_v, sizeof g_v);
+            memcpy(current.eq + i, &eq, sizeof eq);
+        }
+
+        /* Restore the zeros around the cells that were just computed. */
+        current.c[lo-1] = current.g[lo-1] = current.eq[lo-1] = 0;
+        current.c[hi+1] = current.g[hi+1] = current.eq[hi+1] = 0;
+
+        for (i = lo; i <= hi; ++i) {
+            entry.c = current.c[i];
+            entry.g = current.g[i];
+            ENTRY_NAME(c_store)(c, i, s - 1 - i, entry, false);
+        }
+    }
+
+    ctx_free(ctx, xs);
+    ctx_free(ctx, buffer);
+
+    return true;
+}
+
+#undef ENTRY_LANES
+
+#else
+
+static bool
+ENTRY_NAME(table_fill_diagonals)(struct textile_ctx *ctx,
+                                 struct ENTRY_NAME(c_table) c,
+                                 const SYMBOL *x, const SYMBOL *y)
+{
+    return false;
+}
+
+#endif
+
+/*
+ * Fills the c table with the fastest method the options allow.
+ */
+static void
+ENTRY_NAME(table_fill)(const struct textile_options *options,
+                       struct ENTRY_NAME(c_table) c,
+                       const SYMBOL *x, const SYMBOL *y)
+{
+    struct ENTRY_NAME(tile_fill) fill = { .c = c, .x = x, .y = y };
+    unsigned threads = 0;
+    bool filled;
+
+    if (options->threads > 1 && c.m * c.n >= TILES_MIN_CELLS)
+        threads = tiles_run(options->ctx, c.m, c.n, options->threads,
+                ENTRY_NAME(table_fill_tile), &fill);
+    threads_used(options, threads);
+
+    filled = threads != 0;
+    if (!filled && !(options->flags & TEXTILE_NO_SIMD))
+        filled = ENTRY_NAME(table_fill_diagonals)(options->ctx, c, x, y);
+    if (!filled)
+        ENTRY_NAME(table_fill_rows)(c, x, y);
+}
+
+/*
+ * Walks a filled c table from the top left corner and writes out the LCS.
+ * Returns its length.  Adapted from PRINT-LCS(X,i,j).
+ */
+static size_t
+ENTRY_NAME(table_traceback)(struct ENTRY_NAME(c_table) c,
+                            const SYMBOL *x, const SYMBOL *y,
+                            struct textile_match *result)
+{
+    struct textile_match *entry;
+    struct ENTRY_NAME(c_table_entry) current, down, right;
+    size_t i, j, length, m = c.m, n = c.n;
+
+    length = ENTRY_NAME(c_get)(c, 0, 0).c;
+    for (i = 0, j = 0; i != m && j != n; ) {
+        current = ENTRY_NAME(c_get)(c, i, j);
+        if (!current.c)
+            break;
+
+        if (ENTRY_NAME(take_match)(c, x, i, m, y, j, n)) {
+            entry = &result[length - current.c];
+            entry->i = i++;
+            entry->j = j++;
+        } else {
+            down = ENTRY_NAME(c_get)(c, i+1, j);
+            right = ENTRY_NAME(c_get)(c, i, j+1);
+
+            if (down.c != right.c ? down.c > right.c : down.g > right.g)
+                i++;
+            else
+                j++;
+        }
+    }
+
+    return length;
+}
+
+/*
+ * lcs_table() for strings where the shorter one fits in ENTRY_TYPE.
+ */
+static bool
+ENTRY_NAME(lcs_table)(const struct textile_options *options,
+                      const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                      struct textile_match *result, size_t *length)
+{
+    struct ENTRY_NAME(c_table) c;
+
+    if (!ENTRY_NAME(c_table_alloc)(options->ctx, &c, m, n,
+                m * n > C_TABLE_TILED_CELLS)) {
+        return false;
+    }
+
+    ENTRY_NAME(table_fill)(options, c, x, y);
+    *length = ENTRY_NAME(table_traceback)(c, x, y, result);
+
+    scratch_free(options->ctx, c.table);
+
+    return true;
+}
+
+/*
+ * lcs_banded() for strings where the shorter one fits in ENTRY_TYPE.  Gives up
+ * once the band would need more than max_cells entries.
+ */
+static bool
+ENTRY_NAME(lcs_banded)(const struct textile_options *options,
+                       const SYMBOL *x, size_t m, const SYMBOL *y, size_t n,
+                       size_t max_cells, struct textile_match *result,
+                       size_t *length)
+{
+    struct ENTRY_NAME(c_table) c;
+    ptrdiff_t delta = (ptrdiff_t)n - (ptrdiff_t)m, lo, hi;
+    size_t k, edits;
+    bool whole;
+
+    for (k = LCS_BAND_MIN; ; k *= 2) {
+        lo = ((delta < 0) ? delta : 0) - (ptrdiff_t)k;
+        hi = ((delta > 0) ? delta : 0) + (ptrdiff_t)k;
+
+        whole = lo <= 1 - (ptrdiff_t)m && (ptrdiff_t)n - 1 <= hi;
+        if (lo < 1 - (ptrdiff_t)m)
+            lo = 1 - (ptrdiff_t)m;
+        if (hi > (ptrdiff_t)n - 1)
+            hi = (ptrdiff_t)n - 1;
+
+        if ((size_t)(hi - lo + 1) > max_cells / m)
+            return false;
+
+        c.m = m;
+        c.n = n;
+        c.tile_cols = 0;
+        c.band_lo = lo;
+        c.band_width = hi - lo + 1;
+        c.table = scratch_alloc(options->ctx,
+                m * c.band_width * sizeof *c.table);
+        if (!c.table)
+            return false;
+
+        ENTRY_NAME(table_fill_band)(c, x, y);
+
+        /*
+         * A path through the table that leaves the band needs more than
+         * |delta| + 2k inserts and deletes.  If the band has an LCS with
+         * fewer than that, no path outside of it can do better.
+         */
+        edits = m + n - 2 * ENTRY_NAME(c_get)(c, 0, 0).c;
+        if (whole || edits < (size_t)(delta < 0 ? -delta : delta) + 2 * (k + 1))
+            break;
+
+        scratch_free(options->ctx, c.table);
+    }
+
+    *length = ENTRY_NAME(table_traceback)(c, x, y, result);
+    scratch_free(options->ctx, c.table);
+
+    return true;
+}
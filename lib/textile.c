@@ -15,254 +15,756 @@
  */
 
 #include "textile.h"
+#include "textile_walk.h"
 
 #include <assert.h>
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
-/* LCS */
-struct lcs_char {
-    size_t i;
-    size_t j;
-    char ch;
-};
+/*
+ * Memory
+ *
+ * Everything a merge allocates goes through ctx_alloc() and ctx_free() so that
+ * the allocator of the context, if it has one, sees all of it.  Without a
+ * context that is just malloc() and free().
+ *
+ * The LCS results and tables of a merge come from scratch_alloc() instead.  A
+ * context keeps the buffers it hands out there once they come back and hands
+ * them out again to later merges, growing them when they are too small.  A
+ * buffer is only out to one taker at a time.  When they are all out, as in a
+ * merge started from the callbacks of another one, memory comes from
+ * ctx_alloc() as usual.
+ */
+#define SCRATCH_SLOTS 4
 
-struct lcs_string {
-    struct lcs_char *lcs;
-    size_t len;
-};
+/*
+ * With TEXTILE_CTX_HUGE_PAGES, buffers of at least this many bytes are aligned
+ * to it so that they can be backed by huge pages.
+ */
+#define HUGE_PAGE_BYTES (2 << 20)
 
-struct c_table_entry {
-    unsigned short c;
-    unsigned short g;
+struct scratch {
+    void *p;
+    size_t size;
+    bool taken;
 };
 
-struct c_table {
-    struct c_table_entry *table;
-    size_t m;
-    size_t n;
+struct textile_ctx {
+    pthread_mutex_t lock;
+    unsigned flags;
+    struct textile_allocator allocator;
+
+    struct scratch slots[SCRATCH_SLOTS];
 };
 
-struct c_table_entry
-c_get(struct c_table c, size_t i, size_t j)
+static void *
+ctx_alloc(struct textile_ctx *ctx, size_t size)
+{
+    if (ctx && ctx->allocator.alloc)
+        return ctx->allocator.alloc(ctx->allocator.data, size);
+
+    return malloc(size);
+}
+
+/*
+ * Same as ctx_alloc() but zeroes the memory.
+ */
+static void *
+ctx_calloc(struct textile_ctx *ctx, size_t count, size_t size)
+{
+    void *p;
+
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+
+    p = ctx_alloc(ctx, count * size);
+    if (p)
+        memset(p, 0, count * size);
+
+    return p;
+}
+
+static void
+ctx_free(struct textile_ctx *ctx, void *p)
+{
+    if (!p)
+        return;
+
+    if (ctx && ctx->allocator.alloc) {
+        if (ctx->allocator.free)
+            ctx->allocator.free(ctx->allocator.data, p);
+        return;
+    }
+
+    free(p);
+}
+
+struct textile_ctx *
+textile_ctx_new(unsigned flags)
+{
+    return textile_ctx_new_allocator(flags, NULL);
+}
+
+struct textile_ctx *
+textile_ctx_new_allocator(unsigned flags,
+                          const struct textile_allocator *allocator)
+{
+    struct textile_ctx *ctx;
+
+    if (allocator && allocator->alloc)
+        ctx = allocator->alloc(allocator->data, sizeof *ctx);
+    else
+        ctx = malloc(sizeof *ctx);
+    if (!ctx)
+        return NULL;
+
+    memset(ctx, 0, sizeof *ctx);
+    ctx->flags = flags;
+    if (allocator)
+        ctx->allocator = *allocator;
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    return ctx;
+}
+
+void
+textile_ctx_trim(struct textile_ctx *ctx)
 {
-    static struct c_table_entry zero = { .c = 0, .g = 0 };
+    int k;
 
-    if (i>=c.m || j>=c.n)
-        return zero;
+    if (!ctx)
+        return;
 
-    return c.table[c.n*i + j];
+    pthread_mutex_lock(&ctx->lock);
+    for (k = 0; k != SCRATCH_SLOTS; ++k) {
+        if (ctx->slots[k].taken)
+            continue;
+        ctx_free(ctx, ctx->slots[k].p);
+        ctx->slots[k].p = NULL;
+        ctx->slots[k].size = 0;
+    }
+    pthread_mutex_unlock(&ctx->lock);
 }
 
 void
-c_set(struct c_table c, size_t i, size_t j, struct c_table_entry value)
+textile_ctx_free(struct textile_ctx *ctx)
 {
-    c.table[c.n*i + j] = value;
+    if (!ctx)
+        return;
+
+    textile_ctx_trim(ctx);
+    pthread_mutex_destroy(&ctx->lock);
+    ctx_free(ctx, ctx);
 }
 
-size_t max(size_t a, size_t b) {
-    return (a>b) ? a : b;
+/*
+ * Allocates a buffer for a slot of ctx.  Huge pages are only asked for when
+ * the context has no allocator of its own.
+ */
+static void *
+scratch_new(struct textile_ctx *ctx, size_t size)
+{
+    void *p;
+
+    if (!(ctx->flags & TEXTILE_CTX_HUGE_PAGES) || ctx->allocator.alloc
+            || size < HUGE_PAGE_BYTES)
+        return ctx_alloc(ctx, size);
+
+    size = (size + HUGE_PAGE_BYTES - 1) & ~(size_t)(HUGE_PAGE_BYTES - 1);
+    if (posix_memalign(&p, HUGE_PAGE_BYTES, size))
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+    return p;
 }
 
-bool
-take_match(struct c_table c,
-           const char *x, size_t i, size_t m,
-           const char *y, size_t j, size_t n
-           ) {
-    struct c_table_entry current, down, right, diagonal;
-
-    current = c_get(c, i, j);
-    down = c_get(c, i+1, j);
-    right = c_get(c, i, j+1);
-
-    /* Take any opportunity to match sooner than later */
-    if (current.c > down.c && current.c > right.c) {
-        /* Can't find LCS without this match */
-        return true;
-    } else if (current.g > down.g && current.g > right.g) {
-        /* This match is the only way to find the best grouping. */
-        return true;
-    } else if (x[i]==y[j]) {
-        /* We don't need the match for LCS or best grouping */
-        /* Still, take the match if we can */
-        diagonal = c_get(c, i+1, j+1);
-        if (current.g == diagonal.g) {
-            /* Won't hurt to take this match */
-            return true;
-        } else {
-            if (current.g == 1 + diagonal.g) {
-                /* Take the match only if it is not isolated. */
-                if (i && j && x[i-1]==y[j-1]) {
-                    /* This match groups with the previous match */
-                    return true;
-                }
+/*
+ * Returns size bytes from ctx, which may be NULL, or NULL if memory runs out.
+ * The smallest free buffer that is big enough is used.  Failing that, the
+ * biggest free one is replaced by one that is.
+ */
+static void *
+scratch_alloc(struct textile_ctx *ctx, size_t size)
+{
+    struct scratch *fit = NULL, *grow = NULL, *best, *slot;
+    void *p = NULL;
+    int k;
+
+    if (!ctx)
+        return malloc(size);
+
+    pthread_mutex_lock(&ctx->lock);
+    for (k = 0; k != SCRATCH_SLOTS; ++k) {
+        slot = &ctx->slots[k];
+        if (slot->taken)
+            continue;
+        if (slot->size >= size) {
+            if (!fit || slot->size < fit->size)
+                fit = slot;
+        } else if (!grow || slot->size > grow->size) {
+            grow = slot;
+        }
+    }
+
+    best = fit ? fit : grow;
+    if (best && best->size < size) {
+        ctx_free(ctx, best->p);
+        best->p = scratch_new(ctx, size);
+        best->size = best->p ? size : 0;
+    }
+    if (best && best->p) {
+        best->taken = true;
+        p = best->p;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    return best ? p : ctx_alloc(ctx, size);
+}
+
+/*
+ * Gives p back to ctx, or frees it if it didn't come from there.
+ */
+static void
+scratch_free(struct textile_ctx *ctx, void *p)
+{
+    int k;
+
+    if (ctx && p) {
+        pthread_mutex_lock(&ctx->lock);
+        for (k = 0; k != SCRATCH_SLOTS; ++k) {
+            if (ctx->slots[k].p == p) {
+                ctx->slots[k].taken = false;
+                pthread_mutex_unlock(&ctx->lock);
+                return;
             }
         }
+        pthread_mutex_unlock(&ctx->lock);
     }
-    return false;
+
+    ctx_free(ctx, p);
 }
 
-/* lcs
- *
- * Computes the longest common substring of the two strings passed.
- *
- * x - pointer to the first string (not null-terminated)
- * m - length of the first string
- * y - pointer to the second string (not null-terminated)
- * n - length of the second string
- *
- * result - A string of struct lcs_char that represents the result.
- *          It is assumed that memory has been allocated sufficient to hold
- *          the result which could be as long as the shorter of the two
- *          strings.
- *
- * This algorithm was based on the LCS section of "Introduction to Algoritms"
- * by Thomas Cormen, Charles Leiserson, Ronald Rivest and Clifford Stein.
+/*
+ * Big tables are stored as square tiles of 64x64 entries rather than row after
+ * row.  Whether the table is being filled or traced back, the next few cells
+ * are then close by in memory instead of a whole row apart.  Tables under
+ * C_TABLE_TILED_CELLS entries fit in L2 and keep the row-major layout which
+ * wastes no space on padding.
+ */
+#define C_TILE_SHIFT 6
+#define C_TILE_SIZE (1 << C_TILE_SHIFT)
+#define C_TILE_MASK (C_TILE_SIZE - 1)
+#define C_TABLE_TILED_CELLS (1 << 16)
+
+static size_t
+c_tiles(size_t length)
+{
+    return (length + C_TILE_SIZE - 1) >> C_TILE_SHIFT;
+}
+
+size_t max(size_t a, size_t b) {
+    return (a>b) ? a : b;
+}
+
+/*
+ * Threads
  *
- * A few improvements have been made:
+ * The table is cut into square tiles.  A tile only depends on the tiles
+ * below it, to its right and diagonally below and to the right.  So all of
+ * the tiles on an anti-diagonal of tiles can be filled at the same time.  The
+ * workers take turns at the tiles of each anti-diagonal and then wait for each
+ * other before moving on to the next one.
  *
- * 1) I run the algorithm backwards compare to the book.  This tends to find
- *    matches earlier in the string.
- * 2) I added the "g" table which allows me to find an LCS with the most
- *    "grouping" possible.  This is because merging is more difficult when
- *    the common parts are found fragmented all throughout the original strings.
- *    Conflicts are also much more difficult to understand.
- *    Note that this optimization doubles the already greedy memory requirements
- *    of this algorithm.  It most likely adds a constant factor to the runtime
- *    as well.
+ * TILE_SIZE keeps a tile of the widest entries at 256KB so that it stays in
+ * L2 while it is being filled.  Tables with fewer than TILES_MIN_CELLS entries
+ * are not worth starting threads for.
  */
-static size_t
-lcs(const char *x, size_t m, const char *y, size_t n, struct lcs_char *result)
+#define TILE_SIZE 256
+#define TILES_MIN_CELLS (1 << 20)
+
+struct tile_fill {
+    /* Fills tile (a, b) */
+    void (*fill)(void *data, size_t a, size_t b);
+    void *data;
+
+    size_t rows;
+    size_t cols;
+
+    /* Workers wait on started until the main thread has counted them. */
+    pthread_mutex_t lock;
+    pthread_cond_t started;
+    bool ready;
+
+    unsigned workers;
+    pthread_barrier_t barrier;
+};
+
+struct tile_worker {
+    struct tile_fill *fill;
+    unsigned id;
+    pthread_t thread;
+};
+
+static void *
+tile_worker_run(void *arg)
 {
-    struct lcs_char *entry;
-    struct c_table_entry c_entry, current, down, right, diagonal;
-    size_t i, j, length;
+    struct tile_worker *worker = arg;
+    struct tile_fill *fill = worker->fill;
+    size_t wave, a, a_begin, a_end;
 
-    struct c_table c  = { .m = m, .n = n, .table = 0 };
+    pthread_mutex_lock(&fill->lock);
+    while (!fill->ready)
+        pthread_cond_wait(&fill->started, &fill->lock);
+    pthread_mutex_unlock(&fill->lock);
 
-    if (! (x && m && y && n && result)) {
-        return 0;
-    }
+    for (wave = fill->rows + fill->cols - 1; wave != 0; --wave) {
+        /* Tiles (a, b) with a + b == wave - 1 */
+        a_begin = (wave > fill->cols) ? wave - fill->cols : 0;
+        a_end = (wave < fill->rows) ? wave : fill->rows;
 
-    if (USHRT_MAX < m || USHRT_MAX < n) {
-        return 0;
+        for (a = a_begin + worker->id; a < a_end; a += fill->workers)
+            fill->fill(fill->data, a, wave - 1 - a);
+
+        pthread_barrier_wait(&fill->barrier);
     }
 
-    /* This can be quite large. */
-    c.table = malloc(m * n * sizeof (struct c_table_entry));
+    return NULL;
+}
+
+/*
+ * Fills an m by n table with up to the given number of threads, counting the
+ * calling thread.  The workers are allocated from ctx.  fill is called once
+ * for each TILE_SIZE square tile after the tiles it depends on.  Returns the
+ * number of threads that did, or zero without calling it if no extra thread
+ * could be started.
+ */
+static unsigned
+tiles_run(struct textile_ctx *ctx, size_t m, size_t n, unsigned threads,
+          void (*fill_tile)(void *data, size_t a, size_t b), void *data)
+{
+    struct tile_fill fill = {
+        .fill = fill_tile, .data = data,
+        .rows = (m + TILE_SIZE - 1) / TILE_SIZE,
+        .cols = (n + TILE_SIZE - 1) / TILE_SIZE,
+        .ready = false
+    };
+    struct tile_worker *workers;
+    unsigned started, k;
+
+    /* More workers than tiles on the longest anti-diagonal would be idle. */
+    if (threads > fill.rows)
+        threads = fill.rows;
+    if (threads > fill.cols)
+        threads = fill.cols;
+    if (threads < 2)
+        return 0;
 
-    if (!c.table) {
+    workers = ctx_calloc(ctx, threads, sizeof *workers);
+    if (!workers)
         return 0;
+
+    pthread_mutex_init(&fill.lock, NULL);
+    pthread_cond_init(&fill.started, NULL);
+
+    for (started = 1; started != threads; ++started) {
+        workers[started].fill = &fill;
+        workers[started].id = started;
+        if (pthread_create(&workers[started].thread, NULL,
+                    tile_worker_run, &workers[started]))
+            break;
     }
 
-    /* Based on pseudo-code from LCS-LENGTH(X,Y) */
-    /* Here's the O(mn).  Computes the c table from the book. */
-    for (i=m; i!=0; --i) {
-        for (j=n; j!=0; --j) {
-            down = c_get(c, i, j-1);
-            right = c_get(c, i-1, j);
-            diagonal = c_get(c, i, j);
+    if (started > 1) {
+        fill.workers = started;
+        pthread_barrier_init(&fill.barrier, NULL, started);
 
-            c_entry.c = (x[i-1]==y[j-1]) ? diagonal.c+1 : max(down.c, right.c);
+        workers[0].fill = &fill;
+        workers[0].id = 0;
 
-            c_entry.g = 0;
-            if (down.c == c_entry.c)
-                c_entry.g = down.g;
+        pthread_mutex_lock(&fill.lock);
+        fill.ready = true;
+        pthread_cond_broadcast(&fill.started);
+        pthread_mutex_unlock(&fill.lock);
 
-            if (right.c == c_entry.c)
-                c_entry.g = max(right.g, c_entry.g);
+        tile_worker_run(&workers[0]);
 
-            if (x[i-1]==y[j-1]) {
-                c_entry.g = max(diagonal.g, c_entry.g);
-                if (i!=m && j!=n && x[i]==y[j]) {
-                    c_entry.g = max(diagonal.g+1, c_entry.g);
-                }
-            }
+        for (k = 1; k != started; ++k)
+            pthread_join(workers[k].thread, NULL);
 
-            c_set(c, i-1, j-1, c_entry);
-        }
+        pthread_barrier_destroy(&fill.barrier);
     }
 
-    /* Adapted from PRINT-LCS(X,i,j) */
-    length = c_get(c, 0, 0).c;
-    for (i = 0, j = 0; i != m && j != n; ) {
-        current = c_get(c, i, j);
-        if (!current.c)
-            break;
+    pthread_cond_destroy(&fill.started);
+    pthread_mutex_destroy(&fill.lock);
+    ctx_free(ctx, workers);
 
-        if (take_match(c, x, i, m, y, j, n)) {
-            entry = &result[length - current.c];
-            entry->ch = x[i];
-            entry->i = i++;
-            entry->j = j++;
-        } else {
-            down = c_get(c, i+1, j);
-            right = c_get(c, i, j+1);
+    return started > 1 ? started : 0;
+}
 
-            if (down.c != right.c ? down.c > right.c : down.g > right.g)
-                i++;
-            else
-                j++;
-        }
-    }
+/*
+ * Raises *options->threads_used to threads.
+ */
+static void
+threads_used(const struct textile_options *options, unsigned threads)
+{
+    unsigned seen;
+
+    if (!options->threads_used)
+        return;
+
+    seen = __atomic_load_n(options->threads_used, __ATOMIC_RELAXED);
+    while (seen < threads && !__atomic_compare_exchange_n(
+                options->threads_used, &seen, threads, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * SIMD
+ *
+ * The vector kernels below are written with GCC's vector extensions, which
+ * clang understands as well.  On x86 they are compiled for AVX2 and SSE4.2 as
+ * well as the baseline and the best one is picked when the library loads.
+ */
+#if defined(__GNUC__)
+#define HAVE_VECTORS 1
+#endif
+
+#if defined(__GNUC__) && defined(__GLIBC__) \
+        && (defined(__x86_64__) || defined(__i386__)) \
+        && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define TARGET_CLONES \
+    __attribute__((target_clones("avx2", "sse4.2", "default")))
+#endif
+#endif
+
+#ifndef TARGET_CLONES
+#define TARGET_CLONES
+#endif
+
+#ifdef HAVE_VECTORS
+
+/* Every kernel works on vectors of this many bytes. */
+#define VECTOR_BYTES 32
+
+/*
+ * A macro rather than a function so that it is compiled for whichever
+ * instruction set the kernel using it is being cloned for.
+ */
+#define VEC_MAX(type, a, b) ((((type)((a) > (b))) & (a)) \
+        | (~((type)((a) > (b))) & (b)))
+
+typedef unsigned char vec_u8 __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint64_t vec_u64 __attribute__((vector_size(VECTOR_BYTES)));
+
+#endif
+
+/*
+ * For the helpers of the fill loops.  They are passed flags that are known at
+ * compile time and only fold away once the helpers are inlined.
+ */
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/*
+ * A banded table starts out this many diagonals wider on each side than the
+ * difference in length between the two strings.
+ */
+#define LCS_BAND_MIN 16
+
+/*
+ * Symbols of the prefix and suffix that all three inputs share which are left
+ * on each end of the part that goes through the LCS.  See merge_trimmed().
+ */
+#define TRIM_CONTEXT 64
+
+/*
+ * Returns the size in bytes of the c and g fields of a table entry for
+ * strings of these lengths.  Neither can exceed the length of the shorter
+ * string.
+ */
+static size_t
+table_entry_size(size_t m, size_t n)
+{
+    size_t shorter = (m < n) ? m : n;
+
+    if (shorter <= UCHAR_MAX)
+        return sizeof (unsigned char);
+    if (shorter <= USHRT_MAX)
+        return sizeof (unsigned short);
+    if (shorter <= UINT32_MAX)
+        return sizeof (uint32_t);
+    return 0;
+}
+
+/*
+ * Unless the options give a budget of their own, the engines that need more
+ * than linear memory are only picked while they stay under this many bytes.
+ */
+#define LCS_MAX_BYTES (1 << 24)
+
+static size_t
+memory_budget(const struct textile_options *options)
+{
+    return options->max_memory ? options->max_memory : LCS_MAX_BYTES;
+}
 
-    free(c.table);
+/*
+ * Or's engine into the engines_used of the options and passes length through.
+ */
+static size_t
+engine_used(const struct textile_options *options, enum textile_engine engine,
+            size_t length)
+{
+    if (options->engines_used)
+        __atomic_fetch_or(options->engines_used, 1u << engine,
+                __ATOMIC_RELAXED);
 
     return length;
 }
 
-struct cursor {
-    size_t index;
-    size_t begin_index;
+static bool
+table_fits(const struct textile_options *options, size_t m, size_t n)
+{
+    size_t entry = 2 * table_entry_size(m, n);
+
+    if (!entry)
+        return false;
+
+    return n == 0 || m <= memory_budget(options) / entry / n;
+}
 
-    size_t i_len;
-    size_t i_begin;
-    size_t i_end;
+/*
+ * Bit-parallel LCS
+ *
+ * A row of the c table only ever grows by zero or one from one cell to the
+ * next.  So a row fits in a bit vector with one bit per character of the
+ * sequence laid out along it.  A zero bit marks a step where the LCS grows.
+ * Moving to the next row takes a handful of word operations per 64 cells.
+ * This follows "A Note on Bit-Parallel Alignment Computation" by Heikki Hyyrö
+ * which refines the algorithm by Allison and Dix.
+ */
+#define WORD_BITS 64
 
-    size_t j_len;
-    size_t j_begin;
-    size_t j_end;
+struct bit_masks {
+    /*
+     * Maps each byte to its match mask.  Slot 0 is all zeros and stands for
+     * every byte that doesn't occur in the sequence.
+     */
+    unsigned char slot[UCHAR_MAX + 1];
+    uint64_t *masks;
+    size_t slots;
 
-    struct lcs_string *str;
+    size_t words;
+
+    /* Where masks comes from. */
+    struct textile_ctx *ctx;
 };
 
-void cursor_init(struct cursor *c, struct lcs_string *str, size_t i_len, size_t j_len) {
-    c->index = 0;
-    c->begin_index = 0;
-    c->i_begin = 0;
-    c->j_begin = 0;
-    c->i_len = i_len;
-    c->j_len = j_len;
-    c->str = str;
-
-    if (c->index == c->str->len) {
-        c->i_end = c->i_len;
-        c->j_end = c->j_len;
-    } else {
-        c->i_end = c->str->lcs[c->index].i;
-        c->j_end = c->str->lcs[c->index].j;
-    }
+static size_t
+bit_words(size_t length)
+{
+    return (length + WORD_BITS - 1) / WORD_BITS;
 }
 
-void cursor_advance(struct cursor *c, bool advance_begin) {
-    c->index++;
+/*
+ * Builds the match masks for a[0..length).  With reverse set, bit b stands for
+ * a[length-1-b] instead of a[b].  The masks are grown as needed.  Returns false
+ * if memory runs out.
+ */
+static bool
+bit_masks_build(struct bit_masks *bm, const char *a, size_t length,
+                bool reverse)
+{
+    unsigned char ch;
+    size_t b, slots = 1, words = bit_words(length);
+    uint64_t *masks;
+
+    memset(bm->slot, 0, sizeof bm->slot);
+    for (b = 0; b != length; ++b) {
+        ch = a[b];
+        if (!bm->slot[ch])
+            bm->slot[ch] = slots++;
+    }
 
-    if (advance_begin) {
-        c->begin_index = c->index;
-        c->i_begin = c->i_end;
-        c->j_begin = c->j_end;
+    if (bm->slots * bm->words < slots * words) {
+        masks = ctx_alloc(bm->ctx, slots * words * sizeof *masks);
+        if (!masks)
+            return false;
+        ctx_free(bm->ctx, bm->masks);
+        bm->masks = masks;
     }
+    bm->slots = slots;
+    bm->words = words;
 
-    if (c->index >= c->str->len) {
-        c->i_end = c->i_len;
-        c->j_end = c->j_len;
-    } else {
-        c->i_end = c->str->lcs[c->index].i;
-        c->j_end = c->str->lcs[c->index].j;
+    memset(bm->masks, 0, slots * words * sizeof *bm->masks);
+    for (b = 0; b != length; ++b) {
+        ch = a[reverse ? length - 1 - b : b];
+        bm->masks[bm->slot[ch] * words + b / WORD_BITS] |=
+            (uint64_t)1 << (b % WORD_BITS);
     }
+
+    return true;
+}
+
+static void
+bit_masks_free(struct bit_masks *bm)
+{
+    ctx_free(bm->ctx, bm->masks);
+}
+
+/*
+ * Advances the row vector v by one character, ch, of the other sequence.
+ * This is V' = (V + (V & M)) | (V & ~M) with the carry rippling through the
+ * words of the vector.
+ */
+static void
+bit_step(const struct bit_masks *bm, uint64_t *v, char ch)
+{
+    const uint64_t *mask;
+    uint64_t sum, carry = 0, overflow, u;
+    size_t w;
+
+    if (!bm->slot[(unsigned char)ch])
+        return;
+
+    mask = &bm->masks[bm->slot[(unsigned char)ch] * bm->words];
+    for (w = 0; w != bm->words; ++w) {
+        u = v[w] & mask[w];
+        sum = v[w] + u;
+        overflow = sum < u;
+        sum += carry;
+        carry = overflow | (sum < carry);
+        v[w] = sum | (v[w] & ~mask[w]);
+    }
+}
+
+static bool
+bit_test(const uint64_t *v, size_t b)
+{
+    return (v[b / WORD_BITS] >> (b % WORD_BITS)) & 1;
+}
+
+/*
+ * Scratch space for the row computations below.  v must hold a bit for each
+ * character of the longest y passed.
+ */
+struct bit_rows {
+    struct bit_masks bits;
+    uint64_t *v;
+};
+
+/*
+ * Fills row[j] with the length of the LCS of x and y[0..j) for 0 <= j <= n.
+ * The bit vector runs along y so that the whole row comes out at once.
+ */
+static bool
+lcs_row_forward(struct bit_rows *r,
+                const char *x, size_t m, const char *y, size_t n, size_t *row)
+{
+    size_t i, j;
+
+    if (!bit_masks_build(&r->bits, y, n, false))
+        return false;
+
+    memset(r->v, 0xff, r->bits.words * sizeof *r->v);
+    for (i = 0; i != m; ++i)
+        bit_step(&r->bits, r->v, x[i]);
+
+    row[0] = 0;
+    for (j = 0; j != n; ++j)
+        row[j+1] = row[j] + !bit_test(r->v, j);
+
+    return true;
+}
+
+/*
+ * Fills row[j] with the length of the LCS of x and y[j..n) for 0 <= j <= n.
+ * This is the same as lcs_row_forward() run on both sequences reversed.
+ */
+static bool
+lcs_row_backward(struct bit_rows *r,
+                 const char *x, size_t m, const char *y, size_t n, size_t *row)
+{
+    size_t i, j;
+
+    if (!bit_masks_build(&r->bits, y, n, true))
+        return false;
+
+    memset(r->v, 0xff, r->bits.words * sizeof *r->v);
+    for (i = m; i != 0; --i)
+        bit_step(&r->bits, r->v, x[i-1]);
+
+    row[n] = 0;
+    for (j = n; j != 0; --j)
+        row[j-1] = row[j] + !bit_test(r->v, n - j);
+
+    return true;
+}
+
+/*
+ * The bit-parallel engine keeps one row vector for each character of y.  It
+ * is only picked on its own while those stay within the memory budget.
+ */
+static bool
+bits_fit(const struct textile_options *options, size_t m, size_t n)
+{
+    return bit_words(m)
+        <= memory_budget(options) / sizeof (uint64_t) / (n + 1);
+}
+
+/*
+ * When picking an engine on its own, lcs() only trusts Myers' algorithm with
+ * problems that need fewer edits than about 1/16 of the shorter string.
+ * Beyond that the O(mn) engines are competitive and a lot more predictable.
+ */
+static ptrdiff_t
+myers_limit(size_t m, size_t n)
+{
+    return (m < n ? m : n) / 32 + 1;
 }
 
+/*
+ * Patience anchoring
+ *
+ * A line that appears exactly once in x and exactly once in y almost always
+ * pairs up with itself.  Of those pairs, the longest chain that is in order in
+ * both strings is found with patience sorting, as in Bram Cohen's patience
+ * diff.  Those lines are kept as anchors and only the gaps between them are
+ * handed to lcs().  The gaps are independent and usually small so the many
+ * little problems are much cheaper than one big one.
+ *
+ * The result is not always a longest common subsequence but it is the one
+ * that people tend to expect when whole files are merged.  The lines are
+ * split, hashed and paired up in lcs_merge.h, for bytes and for tokens.
+ */
+struct line {
+    size_t begin;
+    size_t len;
+    uint64_t hash;
+};
+
+/*
+ * Slot in the hash table of distinct lines.  count is the number of times the
+ * line was seen in x and in y and index is the line number of its last
+ * occurrence in each.
+ */
+struct line_slot {
+    const struct line *line;
+    size_t count[2];
+    size_t index[2];
+};
+
 /* Notes:
  *
  * Returns true if conflicts occurred.
@@ -279,157 +781,1370 @@ textile_merge(
             const char *, size_t),
         void *data)
 {
-    struct cursor src, dest;
-    struct lcs_string src_lcs, dest_lcs;
-    bool conflicts_found = false;
-    bool equal, only_deletes;
-    size_t old_end;
-
-    /* Compute LCS between base and theirs. */
-    src_lcs.len = max(base_len, theirs_len);
-    src_lcs.lcs = malloc (src_lcs.len * sizeof (struct lcs_char));
-    if (src_lcs.lcs) {
-        src_lcs.len = lcs(base, base_len, theirs, theirs_len, src_lcs.lcs);
-    } else {
-        src_lcs.len = 0;
-    }
-    cursor_init(&src, &src_lcs, base_len, theirs_len);
+    return textile_merge_ex(
+            base, base_len,
+            ours, ours_len,
+            theirs, theirs_len,
+            merged, conflicted, data, NULL);
+}
 
-    /* Compute LCS between base and ours. */
-    dest_lcs.len = max(base_len, ours_len);
-    dest_lcs.lcs = malloc (dest_lcs.len * sizeof (struct lcs_char));
-    if (dest_lcs.lcs) {
-        dest_lcs.len = lcs(base, base_len, ours, ours_len, dest_lcs.lcs);
-    } else {
-        dest_lcs.len = 0;
-    }
-    cursor_init(&dest, &dest_lcs, base_len, ours_len);
-
-    for ( ; src.index <= src_lcs.len && dest.index <= dest_lcs.len;
-            cursor_advance(&src, true), cursor_advance(&dest, true) ) {
-        assert(src.i_begin == dest.i_begin);
-
-        /**
-         * Each time through this loop sets begin to point to a "character"
-         * that matches in all three files.  The first time through the loop is
-         * special in that the matching "character" is the beginning of the
-         * sequence (like ^ in a regular expression.)  It has zero length.
-         */
-
-        if (src.index) {
-            merged(data, ours + dest.j_begin, 1);
-            dest.j_begin++;
-            dest.i_begin++;
-            src.j_begin++;
-            src.i_begin++;
-        }
+static bool
+same(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    return a_len == b_len && !memcmp(a, b, a_len);
+}
 
-        only_deletes = true;
-        if (0 != (src.j_end - src.j_begin))
-            only_deletes = false;
-        if (0 != (dest.j_end - dest.j_begin))
-            only_deletes = false;
-
-        /*
-         * Find an end that matches in all three files.  Do this by advancing
-         * whichever cursor trails in the base file until both cursors point to
-         * the same position in the base file.
-         *
-         * Always guaranteed to find a matching end since EOF will match.
-         * Note that this always finds the first such position relative to
-         * where the begins were set above.
-         */
-        while(src.i_end != dest.i_end) {
-            if(src.i_end < dest.i_end) {
-                old_end = src.j_end;
-                cursor_advance(&src, false);
-                if (1 != (src.j_end - old_end))
-                    only_deletes = false;
-            } else {
-                old_end = dest.j_end;
-                cursor_advance(&dest, false);
-                if (1 != (dest.j_end - old_end))
-                    only_deletes = false;
-            }
-        }
+/*
+ * Merged spans are held back until the next one doesn't continue them in
+ * memory, so that a run of matches is handed over as one span.  Only spans
+ * from the same input are joined, even when the inputs share memory.  With
+ * merged_spans, up to OUT_SPANS of those are handed over at a time.
+ */
+#define OUT_SPANS 64
 
-        /*
-         * i_begin and i_end in each cursor bracket an area where changes have
-         * been made in ours, theirs or both.  It is tight in the sense that
-         * there are no characters within the bounds that match in all three.
-         * Hence, it is not possible to find a smaller subset of changes that
-         * are bound by a character common to all three.
-         */
-
-        assert(src.i_end == dest.i_end);
-
-        /*
-         * Optimize cases where all of the current group of changes are
-         * deletes in either ours, theirs or both.
-         */
-        if (only_deletes) {
-            continue;
-        }
+struct out_buffer {
+    void (*merged)(void *, const char *, size_t);
+    void (*merged_spans)(void *, const struct textile_span *, size_t);
+    void *data;
 
-        /*
-         * Three cases here are considered below.
-         *
-         * 1. Only changed in ours.
-         * 2. Only changed in theirs.
-         * 3. Changed identically in ours and theirs.
-         *
-         * Everything else is a conflict.
-         */
-        if (src.i_end - src.i_begin == src.j_end - src.j_begin) {
-            equal = ! strncmp(
-                    base + src.i_begin,
-                    theirs + src.j_begin,
-                    src.i_end - src.i_begin
-                    );
-            if (equal) {
-                /* theirs is the same as base.  Take ours. */
-                merged(data, ours + dest.j_begin, dest.j_end - dest.j_begin);
-                continue;
-            }
-        }
+    struct textile_span spans[OUT_SPANS];
+    int sources[OUT_SPANS];
+    size_t count;
+};
 
-        if (dest.i_end - dest.i_begin == dest.j_end - dest.j_begin) {
-            equal = ! strncmp(
-                    base + dest.i_begin,
-                    ours + dest.j_begin,
-                    dest.i_end - dest.i_begin
-                    );
-            if (equal) {
-                /* ours is the same as base.  Take theirs. */
-                merged(data, theirs + src.j_begin, src.j_end - src.j_begin);
-                continue;
-            }
-        }
+/*
+ * Where the results of a merge go.  The merge itself only sees sequences of
+ * symbols made from base, ours and theirs.  offsets, where set, map the
+ * position of each symbol to the position of its first byte in text.  There
+ * is one more offset than there are symbols.  Without offsets, each symbol is
+ * unit bytes of text.
+ *
+ * Merged spans go to buffer which always hands them to the caller of
+ * textile_merge_ex().  Conflicts go to conflicted with data.
+ */
+enum { MERGE_BASE, MERGE_OURS, MERGE_THEIRS };
 
-        if (src.j_end - src.j_begin == dest.j_end - dest.j_begin) {
-            equal = ! strncmp(
-                    theirs + src.j_begin,
-                    ours + dest.j_begin,
-                    dest.j_end - dest.j_begin
-                    );
-            if (equal) {
-                /* ours is the same as theirs.  Take ours. */
-                merged(data, ours + dest.j_begin, dest.j_end - dest.j_begin);
-                continue;
-            }
-        }
+struct merge_out {
+    void (*conflicted)(void *,
+            const char *, size_t,
+            const char *, size_t,
+            const char *, size_t);
+    void *data;
+
+    const char *text[3];
+    const size_t *offsets[3];
+    size_t unit;
+
+    struct out_buffer *buffer;
+};
 
-        conflicts_found = true;
+static size_t
+out_offset(const struct merge_out *out, int which, size_t k)
+{
+    return out->offsets[which] ? out->offsets[which][k] : k * out->unit;
+}
+
+/*
+ * Hands the spans held back so far to the caller.
+ */
+static void
+out_flush(const struct merge_out *out)
+{
+    struct out_buffer *b = out->buffer;
+    size_t k;
+
+    if (!b->count)
+        return;
+
+    if (b->merged_spans) {
+        b->merged_spans(b->data, b->spans, b->count);
+    } else {
+        for (k = 0; k != b->count; ++k)
+            b->merged(b->data, b->spans[k].text, b->spans[k].len);
+    }
+    b->count = 0;
+}
+
+/*
+ * Hands symbols begin..end of one of the three to the merged callback.
+ */
+static void
+out_merged(const struct merge_out *out, int which, size_t begin, size_t end)
+{
+    struct out_buffer *b = out->buffer;
+    struct textile_span *last;
+    const char *text;
 
-        conflicted( data,
-            base + dest.i_begin, dest.i_end - dest.i_begin,
-            ours + dest.j_begin, dest.j_end - dest.j_begin,
-            theirs + src.j_begin, src.j_end - src.j_begin
-        );
+    begin = out_offset(out, which, begin);
+    end = out_offset(out, which, end);
+    if (begin == end)
+        return;
+
+    text = out->text[which] + begin;
+    if (b->count) {
+        last = &b->spans[b->count - 1];
+        if (b->sources[b->count - 1] == which
+                && last->text + last->len == text) {
+            last->len += end - begin;
+            return;
+        }
     }
 
-    if (dest_lcs.lcs) free(dest_lcs.lcs);
-    if (src_lcs.lcs) free(src_lcs.lcs);
+    if (b->count == (b->merged_spans ? OUT_SPANS : 1))
+        out_flush(out);
+
+    b->spans[b->count].text = text;
+    b->spans[b->count].len = end - begin;
+    b->sources[b->count] = which;
+    b->count++;
+}
+
+/*
+ * Hands the three ranges of symbols to the conflicted callback.
+ */
+static void
+out_conflicted(const struct merge_out *out,
+               size_t base_begin, size_t base_end,
+               size_t ours_begin, size_t ours_end,
+               size_t theirs_begin, size_t theirs_end)
+{
+    base_begin = out_offset(out, MERGE_BASE, base_begin);
+    base_end = out_offset(out, MERGE_BASE, base_end);
+    ours_begin = out_offset(out, MERGE_OURS, ours_begin);
+    ours_end = out_offset(out, MERGE_OURS, ours_end);
+    theirs_begin = out_offset(out, MERGE_THEIRS, theirs_begin);
+    theirs_end = out_offset(out, MERGE_THEIRS, theirs_end);
+
+    out_flush(out);
+    out->conflicted(out->data,
+            out->text[MERGE_BASE] + base_begin, base_end - base_begin,
+            out->text[MERGE_OURS] + ours_begin, ours_end - ours_begin,
+            out->text[MERGE_THEIRS] + theirs_begin, theirs_end - theirs_begin);
+}
+
+void
+textile_alignment_free(struct textile_alignment *a)
+{
+    int k;
+
+    scratch_free(a->ctx, a->dest.matches);
+    scratch_free(a->ctx, a->src.matches);
+    for (k = 0; k != 3; ++k) {
+        ctx_free(a->ctx, a->ids[k]);
+        ctx_free(a->ctx, a->offsets[k]);
+    }
+}
+
+/*
+ * Hands what a step of the walk found to out.  The walk started at symbol
+ * start of all three.  Returns true for a conflict.
+ */
+static bool
+out_step(const struct merge_out *out, const struct textile_walk_step *step,
+         size_t start)
+{
+    const struct textile_hunk *h = &step->hunk;
+    int which = h->source;
+
+    if (step->matched)
+        out_merged(out, MERGE_OURS,
+                start + step->match, start + step->match + 1);
+
+    if (!step->changed)
+        return false;
+
+    if (h->kind == TEXTILE_HUNK_MERGED) {
+        out_merged(out, which, start + h->offset[which],
+                start + h->offset[which] + h->len[which]);
+        return false;
+    }
+
+    out_conflicted(out,
+            start + h->offset[MERGE_BASE],
+            start + h->offset[MERGE_BASE] + h->len[MERGE_BASE],
+            start + h->offset[MERGE_OURS],
+            start + h->offset[MERGE_OURS] + h->len[MERGE_OURS],
+            start + h->offset[MERGE_THEIRS],
+            start + h->offset[MERGE_THEIRS] + h->len[MERGE_THEIRS]);
+    return true;
+}
+
+/*
+ * The engines for bytes make use of an index of base when they are given one.
+ */
+static struct textile_index *
+index_build(struct textile_ctx *ctx, const char *base, size_t base_len);
+
+static bool
+index_covers(const struct textile_index *index, const char *x, size_t m);
+
+static size_t
+index_lines(struct textile_ctx *ctx, const struct textile_index *index,
+            const char *x, size_t m, struct line **lines);
+
+static const struct bit_masks *
+index_bits(struct textile_index *index, const char *x, size_t m);
+
+#define SYMBOL char
+#define SYMBOL_SIGNED signed char
+#define SYMBOL_NAME(name) name
+#define SYMBOL_NEWLINE '\n'
+#define SYMBOL_BYTES
+#include "lcs_merge.h"
+#undef SYMBOL_BYTES
+#undef SYMBOL_NEWLINE
+#undef SYMBOL_NAME
+#undef SYMBOL_SIGNED
+#undef SYMBOL
+
+/*
+ * Index of a base text
+ *
+ * Everything about base that the engines would otherwise work out for each
+ * side of each merge.  The lines of base are split and hashed up front.  The
+ * match masks for lcs_bits() are only built the first time they are needed,
+ * under lock, since most merges never get that far.
+ */
+struct textile_index {
+    const char *base;
+    size_t len;
+
+    struct line *lines;
+    size_t count;
+
+    pthread_mutex_t lock;
+    struct bit_masks bits;
+    bool has_bits;
+
+    /* Everything above is allocated from here. */
+    struct textile_ctx *ctx;
+};
+
+/*
+ * textile_index_build() with memory from ctx.
+ */
+static struct textile_index *
+index_build(struct textile_ctx *ctx, const char *base, size_t base_len)
+{
+    struct textile_index *index;
+
+    if (!base || !base_len)
+        return NULL;
+
+    index = ctx_calloc(ctx, 1, sizeof *index);
+    if (!index)
+        return NULL;
+
+    index->ctx = ctx;
+    index->bits.ctx = ctx;
+    index->base = base;
+    index->len = base_len;
+    index->count = lines_split(ctx, base, base_len, &index->lines);
+    if (!index->count) {
+        ctx_free(ctx, index);
+        return NULL;
+    }
+    pthread_mutex_init(&index->lock, NULL);
+
+    return index;
+}
+
+struct textile_index *
+textile_index_build(const char *base, size_t base_len)
+{
+    return index_build(NULL, base, base_len);
+}
+
+void
+textile_index_free(struct textile_index *index)
+{
+    if (!index)
+        return;
+
+    pthread_mutex_destroy(&index->lock);
+    bit_masks_free(&index->bits);
+    ctx_free(index->ctx, index->lines);
+    ctx_free(index->ctx, index);
+}
+
+/*
+ * Whether x[0..m) lies within the indexed base.
+ */
+static bool
+index_covers(const struct textile_index *index, const char *x, size_t m)
+{
+    return index && index->base <= x && m <= index->len
+        && (size_t)(x - index->base) <= index->len - m;
+}
+
+/*
+ * Same as lines_split() for x[0..m) but copies the lines from the index.  Only
+ * a line cut by either end of x is hashed again.
+ */
+static size_t
+index_lines(struct textile_ctx *ctx, const struct textile_index *index,
+            const char *x, size_t m, struct line **lines)
+{
+    const struct line *all = index->lines;
+    size_t off = x - index->base, end = off + m, pos, k, lo, hi, mid, count;
+
+    /* all[lo..hi) are the lines that start within x. */
+    for (lo = 0, hi = index->count; lo != hi; ) {
+        mid = (lo + hi) / 2;
+        if (all[mid].begin < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (hi = index->count, k = lo; k != hi; ) {
+        mid = (k + hi) / 2;
+        if (all[mid].begin < end)
+            k = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *lines = ctx_alloc(ctx, (hi - lo + 1) * sizeof **lines);
+    if (!*lines)
+        return 0;
+
+    for (pos = off, k = lo, count = 0; pos != end;
+            pos += (*lines)[count++].len) {
+        if (k != hi && all[k].begin == pos && pos + all[k].len <= end) {
+            (*lines)[count] = all[k++];
+        } else {
+            /* Cut short by the end of x or starts before it. */
+            line_make(index->base, pos,
+                    (k != hi && all[k].begin > pos) ? all[k].begin : end,
+                    &(*lines)[count]);
+        }
+        (*lines)[count].begin -= off;
+    }
+
+    return count;
+}
+
+/*
+ * Returns the match masks of lcs_bits() for x[0..m), reversed, if x is the
+ * whole of the indexed base.  Returns NULL otherwise or if memory runs out.
+ */
+static const struct bit_masks *
+index_bits(struct textile_index *index, const char *x, size_t m)
+{
+    const struct bit_masks *bits = NULL;
+
+    if (!index || x != index->base || m != index->len)
+        return NULL;
+
+    pthread_mutex_lock(&index->lock);
+    if (!index->has_bits)
+        index->has_bits = bit_masks_build(&index->bits, x, m, true);
+    if (index->has_bits)
+        bits = &index->bits;
+    pthread_mutex_unlock(&index->lock);
+
+    return bits;
+}
+
+/*
+ * Tokens
+ *
+ * TEXTILE_TOKENS cuts each text into identifiers, numbers, runs of blanks,
+ * line breaks and single characters of anything else.  Equal tokens are
+ * interned to the same 32 bit ID, numbered densely from zero, and the merge
+ * runs over the IDs.  Typical source code has several times fewer tokens than
+ * bytes so the tables shrink by the square of that.  Matches are also whole
+ * tokens rather than the odd letters two different identifiers share.
+ *
+ * A line break is always interned first so that the engines can still find
+ * lines among the IDs.
+ *
+ * TEXTILE_LINES interns whole lines the same way for a first pass over the
+ * whole file.  There, the lone line break is an empty line and the engines
+ * anchor on runs of lines between empty ones.
+ */
+#define TOKEN_NEWLINE 0
+
+struct tokens {
+    uint32_t *ids;
+
+    /* Token k is bytes offsets[k] to offsets[k+1] of the text. */
+    size_t *offsets;
+    size_t count;
+};
+
+/*
+ * Slot in the hash table of distinct tokens.  Empty slots have no text.
+ */
+struct token_slot {
+    const char *text;
+    size_t len;
+    uint64_t hash;
+    uint32_t id;
+};
+
+struct token_table {
+    struct token_slot *slots;
+    size_t size;
+    size_t count;
+
+    /* Where the slots and the tokens split with the table come from. */
+    struct textile_ctx *ctx;
+};
+
+static bool
+token_word(unsigned char ch)
+{
+    /* Bytes of UTF-8 sequences are taken to be letters. */
+    return ch == '_' || ch >= 0x80 || (ch >= '0' && ch <= '9')
+        || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z');
+}
+
+static bool
+token_blank(unsigned char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
+/*
+ * Returns the end of the token of a that starts at begin.
+ */
+static size_t
+token_end(const char *a, size_t len, size_t begin)
+{
+    unsigned char ch = a[begin];
+    size_t k = begin + 1;
+
+    if (ch >= '0' && ch <= '9') {
+        /* Numbers take their suffixes, hex digits and decimal points. */
+        while (k != len && (token_word(a[k]) || a[k] == '.'))
+            ++k;
+    } else if (token_word(ch)) {
+        while (k != len && token_word(a[k]))
+            ++k;
+    } else if (token_blank(ch)) {
+        while (k != len && token_blank(a[k]))
+            ++k;
+    }
+
+    return k;
+}
+
+/*
+ * Returns the ID of the token a[0..len), interning it if it is new.  Returns
+ * false if memory runs out or there are more distinct tokens than IDs.
+ */
+static bool
+token_intern(struct token_table *table, const char *a, size_t len,
+             uint32_t *id)
+{
+    struct token_slot *slots, *slot;
+    size_t k, mask, size;
+    uint64_t hash;
+
+    /* Kept at most half full */
+    if (2 * (table->count + 1) > table->size) {
+        if (table->count == UINT32_MAX)
+            return false;
+
+        size = table->size ? 2 * table->size : 1024;
+        slots = ctx_calloc(table->ctx, size, sizeof *slots);
+        if (!slots)
+            return false;
+
+        for (k = 0; k != table->size; ++k) {
+            slot = &table->slots[k];
+            if (!slot->text)
+                continue;
+            for (mask = slot->hash & (size - 1); slots[mask].text;
+                    mask = (mask + 1) & (size - 1))
+                ;
+            slots[mask] = *slot;
+        }
+
+        ctx_free(table->ctx, table->slots);
+        table->slots = slots;
+        table->size = size;
+    }
+
+    /* FNV-1a */
+    hash = 14695981039346656037ULL;
+    for (k = 0; k != len; ++k)
+        hash = (hash ^ (unsigned char)a[k]) * 1099511628211ULL;
+
+    mask = table->size - 1;
+    for (k = hash & mask; ; k = (k + 1) & mask) {
+        slot = &table->slots[k];
+        if (!slot->text) {
+            slot->text = a;
+            slot->len = len;
+            slot->hash = hash;
+            slot->id = table->count++;
+            break;
+        }
+        if (slot->hash == hash && slot->len == len
+                && !memcmp(slot->text, a, len))
+            break;
+    }
+
+    *id = slot->id;
+
+    return true;
+}
+
+/*
+ * Returns the end of the line of a that starts at begin, line break included.
+ */
+static size_t
+line_end(const char *a, size_t len, size_t begin)
+{
+    const char *newline = memchr(a + begin, '\n', len - begin);
+
+    return newline ? (size_t)(newline - a) + 1 : len;
+}
+
+/*
+ * Cuts a into pieces with cut, which is token_end or line_end, and interns
+ * them in table.  Returns false if memory runs out.
+ */
+static bool
+tokens_split(struct token_table *table, const char *a, size_t len,
+             size_t (*cut)(const char *, size_t, size_t),
+             struct tokens *tokens)
+{
+    size_t begin, end, count = 0;
+
+    for (begin = 0; begin != len; begin = cut(a, len, begin))
+        count++;
+
+    tokens->count = 0;
+    tokens->ids = ctx_alloc(table->ctx, (count + 1) * sizeof *tokens->ids);
+    tokens->offsets = ctx_alloc(table->ctx,
+            (count + 1) * sizeof *tokens->offsets);
+    if (!tokens->ids || !tokens->offsets)
+        return false;
+
+    for (begin = 0; begin != len; begin = end) {
+        end = cut(a, len, begin);
+        tokens->offsets[tokens->count] = begin;
+        if (!token_intern(table, a + begin, end - begin,
+                    &tokens->ids[tokens->count]))
+            return false;
+        tokens->count++;
+    }
+    tokens->offsets[tokens->count] = len;
+
+    return true;
+}
+
+#define SYMBOL uint32_t
+#define SYMBOL_SIGNED int32_t
+#define SYMBOL_NAME(name) name##_u32
+#define SYMBOL_NEWLINE TOKEN_NEWLINE
+#include "lcs_merge.h"
+#undef SYMBOL_NEWLINE
+#undef SYMBOL_NAME
+#undef SYMBOL_SIGNED
+#undef SYMBOL
+
+/*
+ * Splits all three texts with cut and fills in a with the IDs.  Returns false,
+ * leaving a as it was, if memory runs out.
+ */
+static bool
+align_split(struct textile_alignment *a, const char *const text[3],
+            const size_t lens[3],
+            size_t (*cut)(const char *, size_t, size_t),
+            const struct textile_options *options)
+{
+    struct token_table table = {
+        .slots = NULL, .size = 0, .count = 0, .ctx = options->ctx
+    };
+    struct tokens tokens[3];
+    uint32_t newline;
+    bool split;
+    int k;
+
+    memset(tokens, 0, sizeof tokens);
+    split = token_intern(&table, "\n", 1, &newline);
+    for (k = 0; k != 3 && split; ++k)
+        split = tokens_split(&table, text[k], lens[k], cut, &tokens[k]);
+    ctx_free(table.ctx, table.slots);
+
+    if (!split) {
+        for (k = 0; k != 3; ++k) {
+            ctx_free(table.ctx, tokens[k].ids);
+            ctx_free(table.ctx, tokens[k].offsets);
+        }
+        return false;
+    }
+
+    for (k = 0; k != 3; ++k) {
+        a->ids[k] = tokens[k].ids;
+        a->offsets[k] = tokens[k].offsets;
+    }
+    align_trimmed_u32(a,
+            tokens[MERGE_BASE].ids, tokens[MERGE_BASE].count,
+            tokens[MERGE_OURS].ids, tokens[MERGE_OURS].count,
+            tokens[MERGE_THEIRS].ids, tokens[MERGE_THEIRS].count, options);
+
+    return true;
+}
+
+/*
+ * Works out the coarsest level of the merge of text that the options ask for
+ * and says how the conflicts found there are to be merged again, so that the
+ * next finer level runs only inside them.
+ */
+static void
+align(struct textile_alignment *a, const char *const text[3],
+      const size_t lens[3], const struct textile_options *options)
+{
+    int k;
+
+    memset(a, 0, sizeof *a);
+    a->whole = -1;
+    a->flags = options->flags;
+    a->ctx = options->ctx;
+    for (k = 0; k != 3; ++k)
+        a->len[k] = lens[k];
+
+    /*
+     * When two of the three are the same, the answer is known without
+     * comparing anything else.
+     */
+    if (same(text[MERGE_OURS], lens[MERGE_OURS],
+                text[MERGE_THEIRS], lens[MERGE_THEIRS])
+            || same(text[MERGE_BASE], lens[MERGE_BASE],
+                text[MERGE_THEIRS], lens[MERGE_THEIRS])) {
+        a->whole = MERGE_OURS;
+        return;
+    }
+    if (same(text[MERGE_BASE], lens[MERGE_BASE],
+                text[MERGE_OURS], lens[MERGE_OURS])) {
+        a->whole = MERGE_THEIRS;
+        return;
+    }
+
+    if (a->flags & TEXTILE_LINES) {
+        a->flags &= ~TEXTILE_LINES;
+        if (align_split(a, text, lens, line_end, options)) {
+            a->cascade = true;
+            a->limit = (a->flags & TEXTILE_TOKENS)
+                ? options->token_limit : options->byte_limit;
+            return;
+        }
+    }
+
+    /* Falls back to bytes if memory runs out. */
+    if (a->flags & TEXTILE_TOKENS) {
+        a->flags &= ~TEXTILE_TOKENS;
+        if (align_split(a, text, lens, token_end, options)) {
+            a->cascade = (a->flags & TEXTILE_CASCADE) != 0;
+            a->limit = options->byte_limit;
+            return;
+        }
+    }
+
+    align_trimmed(a, text[MERGE_BASE], lens[MERGE_BASE],
+            text[MERGE_OURS], lens[MERGE_OURS],
+            text[MERGE_THEIRS], lens[MERGE_THEIRS], options);
+}
+
+void
+textile_align(const char *base, size_t base_len,
+              const char *ours, size_t ours_len,
+              const char *theirs, size_t theirs_len,
+              const struct textile_options *options,
+              struct textile_alignment *alignment)
+{
+    static const struct textile_options defaults = { 0 };
+    const char *const text[3] = { base, ours, theirs };
+    const size_t lens[3] = { base_len, ours_len, theirs_len };
+
+    align(alignment, text, lens, options ? options : &defaults);
+}
+
+/*
+ * Takes the walk over a, which is of bytes or of IDs, one step.
+ */
+static bool
+align_walk_next(struct textile_walk *w, const struct textile_alignment *a,
+                struct textile_walk_step *step)
+{
+    if (a->size == sizeof (uint32_t))
+        return textile_walk_next_u32(w, a, step);
+
+    return textile_walk_next(w, a, step);
+}
+
+/*
+ * Runs a whole merge, handing merged spans over the way handlers does.
+ */
+static bool
+merge_run(const char *base, size_t base_len,
+          const char *ours, size_t ours_len,
+          const char *theirs, size_t theirs_len,
+          const struct out_buffer *handlers,
+          void (*conflicted)(void *,
+              const char *, size_t,
+              const char *, size_t,
+              const char *, size_t),
+          void *data,
+          const struct textile_options *options);
+
+/*
+ * Where a level that cascades sends its conflicts.  Each one goes back to
+ * merge_run() with the flags of the next finer level, unless it is longer
+ * than limit, counting base and both sides, in which case it is reported as
+ * it is.  Zero means no limit.
+ */
+struct cascade {
+    const struct out_buffer *buffer;
+    void (*conflicted)(void *,
+        const char *, size_t,
+        const char *, size_t,
+        const char *, size_t);
+    void *data;
+    struct textile_options options;
+    size_t limit;
+    bool conflicts_found;
+};
+
+static void
+cascade_conflicted(void *data,
+                   const char *base, size_t base_len,
+                   const char *ours, size_t ours_len,
+                   const char *theirs, size_t theirs_len)
+{
+    struct cascade *pass = data;
+
+    if (pass->limit && base_len + ours_len + theirs_len > pass->limit) {
+        pass->conflicted(pass->data, base, base_len, ours, ours_len,
+                theirs, theirs_len);
+        pass->conflicts_found = true;
+        return;
+    }
+
+    if (merge_run(base, base_len, ours, ours_len, theirs, theirs_len,
+                pass->buffer, pass->conflicted, pass->data, &pass->options))
+        pass->conflicts_found = true;
+}
+
+/*
+ * Sets up pass for the conflicts of a and points the conflicts of out at it.
+ */
+static void
+cascade_init(struct cascade *pass, struct merge_out *out,
+             const struct textile_alignment *a,
+             const struct textile_options *options)
+{
+    pass->buffer = out->buffer;
+    pass->conflicted = out->conflicted;
+    pass->data = out->data;
+    pass->options = *options;
+    pass->options.flags = a->flags;
+    pass->limit = a->limit;
+    pass->conflicts_found = false;
+
+    out->conflicted = cascade_conflicted;
+    out->data = pass;
+}
+
+static bool
+merge_run(const char *base, size_t base_len,
+          const char *ours, size_t ours_len,
+          const char *theirs, size_t theirs_len,
+          const struct out_buffer *handlers,
+          void (*conflicted)(void *,
+              const char *, size_t,
+              const char *, size_t,
+              const char *, size_t),
+          void *data,
+          const struct textile_options *options)
+{
+    struct out_buffer buffer = {
+        .merged = handlers->merged,
+        .merged_spans = handlers->merged_spans,
+        .data = handlers->data, .count = 0
+    };
+    struct merge_out out = {
+        .conflicted = conflicted, .data = data,
+        .text = { base, ours, theirs },
+        .offsets = { NULL, NULL, NULL },
+        .unit = 1,
+        .buffer = &buffer
+    };
+    const size_t lens[3] = { base_len, ours_len, theirs_len };
+    struct textile_alignment a;
+    struct cascade pass;
+    bool conflicts_found = false;
+    int k;
+
+    align(&a, out.text, lens, options);
+    if (a.whole >= 0) {
+        out_merged(&out, a.whole, 0, a.len[a.whole]);
+    } else {
+        for (k = 0; k != 3; ++k)
+            out.offsets[k] = a.offsets[k];
+        if (a.cascade)
+            cascade_init(&pass, &out, &a, options);
+
+        if (a.size == sizeof (uint32_t))
+            conflicts_found = merge_walk_u32(&a, &out);
+        else
+            conflicts_found = merge_walk(&a, &out);
+
+        if (a.cascade)
+            conflicts_found = pass.conflicts_found;
+    }
+
+    out_flush(&out);
+    textile_alignment_free(&a);
+
+    return conflicts_found;
+}
+
+bool
+textile_merge_ex(
+        const char *base, size_t base_len,
+        const char *ours, size_t ours_len,
+        const char *theirs, size_t theirs_len,
+        void (*merged)(void *, const char *, size_t),
+        void (*conflicted)(void *,
+            const char *, size_t,
+            const char *, size_t,
+            const char *, size_t),
+        void *data,
+        const struct textile_options *options)
+{
+    static const struct textile_options defaults = { 0 };
+    struct out_buffer handlers = { .merged = merged, .data = data };
+
+    if (!options)
+        options = &defaults;
+    handlers.merged_spans = options->merged_spans;
+
+    return merge_run(base, base_len, ours, ours_len, theirs, theirs_len,
+            &handlers, conflicted, data, options);
+}
+
+/*
+ * Output
+ *
+ * textile_merge_to_buffer() copies each piece of the result straight to the
+ * caller's buffer as textile_merge_ex() hands it over.
+ */
+static const struct textile_markers default_markers = {
+    .ours = "<<<<<<<", .base = "|||||||", .theirs = "=======", .end = ">>>>>>>"
+};
+
+struct buffer_out {
+    const struct textile_markers *markers;
+    char *buffer;
+    size_t size;
+    size_t length;
+};
+
+static void
+buffer_write(struct buffer_out *b, const char *s, size_t len)
+{
+    if (b->length < b->size)
+        memcpy(b->buffer + b->length, s,
+                (len < b->size - b->length) ? len : b->size - b->length);
+    b->length += len;
+}
+
+static void
+buffer_marker(struct buffer_out *b, const char *marker)
+{
+    buffer_write(b, marker, strlen(marker));
+}
+
+static void
+buffer_merged(void *data, const struct textile_span *spans, size_t count)
+{
+    size_t k;
+
+    for (k = 0; k != count; ++k)
+        buffer_write(data, spans[k].text, spans[k].len);
+}
+
+static void
+buffer_conflicted(void *data,
+                  const char *base, size_t base_len,
+                  const char *ours, size_t ours_len,
+                  const char *theirs, size_t theirs_len)
+{
+    struct buffer_out *b = data;
+
+    buffer_marker(b, b->markers->ours);
+    buffer_write(b, ours, ours_len);
+    if (b->markers->base) {
+        buffer_marker(b, b->markers->base);
+        buffer_write(b, base, base_len);
+    }
+    buffer_marker(b, b->markers->theirs);
+    buffer_write(b, theirs, theirs_len);
+    buffer_marker(b, b->markers->end);
+}
+
+/*
+ * Every byte of each input is written at most once.  Two conflicts are always
+ * apart by at least a byte that all three share so there can be no more of
+ * them than one plus the length of the shortest input.
+ */
+size_t
+textile_merge_bound(size_t base_len, size_t ours_len, size_t theirs_len,
+                    const struct textile_markers *markers)
+{
+    size_t shortest, conflicts, marker_len, total;
+
+    if (!markers)
+        markers = &default_markers;
+
+    shortest = base_len;
+    if (ours_len < shortest)
+        shortest = ours_len;
+    if (theirs_len < shortest)
+        shortest = theirs_len;
+    conflicts = shortest + 1;
+
+    marker_len = strlen(markers->ours) + strlen(markers->theirs)
+        + strlen(markers->end);
+    if (markers->base)
+        marker_len += strlen(markers->base);
+
+    total = base_len + ours_len;
+    if (total < base_len || total + theirs_len < total)
+        return SIZE_MAX;
+    total += theirs_len;
+
+    if (marker_len && conflicts > (SIZE_MAX - total) / marker_len)
+        return SIZE_MAX;
+
+    return total + conflicts * marker_len;
+}
+
+bool
+textile_merge_to_buffer(
+        const char *base, size_t base_len,
+        const char *ours, size_t ours_len,
+        const char *theirs, size_t theirs_len,
+        char *buffer, size_t size, size_t *length,
+        const struct textile_markers *markers,
+        const struct textile_options *options)
+{
+    struct textile_options buffered = { 0 };
+    struct buffer_out b = {
+        .markers = markers ? markers : &default_markers,
+        .buffer = buffer, .size = size, .length = 0
+    };
+    bool conflicts_found;
+
+    if (options)
+        buffered = *options;
+    buffered.merged_spans = buffer_merged;
+
+    conflicts_found = textile_merge_ex(base, base_len, ours, ours_len,
+            theirs, theirs_len, NULL, buffer_conflicted, &b, &buffered);
+    *length = b.length;
+
+    return conflicts_found;
+}
+
+/*
+ * Hunks
+ *
+ * textile_merge_begin() works out the coarsest level of the merge and each
+ * call to textile_merge_next() walks it only as far as the next hunk.  A
+ * conflict that the next finer level is to merge again is worked out when the
+ * walk gets to it and walked in turn before the level above goes on.  So
+ * nothing past the hunks asked for is ever computed.  A merged hunk is held
+ * back until the next hunk is known, so that a run of matches from one input
+ * is handed out as one hunk, as textile_merge_ex() does.
+ */
+#define ITER_LEVELS 3
+
+/*
+ * A level being walked.  out only serves to map its symbols to bytes.
+ */
+struct iter_level {
+    struct textile_alignment alignment;
+    struct textile_walk walk;
+    struct merge_out out;
+    bool started;
+};
+
+struct textile_merge_iter {
+    struct textile_options options;
+    const char *text[3];
+
+    struct iter_level levels[ITER_LEVELS];
+    size_t depth;
+
+    /* Hunks to hand out, in order, and the merged one that may yet grow. */
+    struct textile_hunk ready[3];
+    size_t ready_count;
+    struct textile_hunk held;
+    bool holding;
+
+    bool conflicts_found;
+};
+
+/*
+ * Starts walking the merge of text with flags, one level down from the one
+ * being walked, if any.
+ */
+static void
+iter_push(struct textile_merge_iter *iter, const char *const text[3],
+          const size_t lens[3], unsigned flags)
+{
+    struct iter_level *level = &iter->levels[iter->depth++];
+    struct textile_options options = iter->options;
+    int k;
+
+    assert(iter->depth <= ITER_LEVELS);
+
+    options.flags = flags;
+    align(&level->alignment, text, lens, &options);
+
+    memset(&level->out, 0, sizeof level->out);
+    for (k = 0; k != 3; ++k) {
+        level->out.text[k] = text[k];
+        level->out.offsets[k] = level->alignment.offsets[k];
+    }
+    level->out.unit = 1;
+    level->started = false;
+}
+
+static void
+iter_pop(struct textile_merge_iter *iter)
+{
+    struct iter_level *level = &iter->levels[--iter->depth];
+
+    textile_alignment_free(&level->alignment);
+}
+
+/*
+ * Same as out_merged() for the level being walked.
+ */
+static void
+iter_merged(struct textile_merge_iter *iter, int which,
+            size_t begin, size_t end)
+{
+    struct iter_level *level = &iter->levels[iter->depth - 1];
+    struct textile_hunk *held = &iter->held;
+    size_t offset;
+
+    begin = out_offset(&level->out, which, begin);
+    end = out_offset(&level->out, which, end);
+    if (begin == end)
+        return;
+
+    offset = level->out.text[which] + begin - iter->text[which];
+    if (iter->holding && held->source == (enum textile_source) which
+            && held->offset[which] + held->len[which] == offset) {
+        held->len[which] += end - begin;
+        return;
+    }
+
+    if (iter->holding)
+        iter->ready[iter->ready_count++] = *held;
+
+    memset(held, 0, sizeof *held);
+    held->kind = TEXTILE_HUNK_MERGED;
+    held->source = (enum textile_source) which;
+    held->offset[which] = offset;
+    held->len[which] = end - begin;
+    iter->holding = true;
+}
+
+/*
+ * Same as out_conflicted() for the level being walked.  The conflict is
+ * either merged again a level down or handed out as it is.
+ */
+static void
+iter_conflicted(struct textile_merge_iter *iter,
+                const struct textile_hunk *h, size_t start)
+{
+    struct iter_level *level = &iter->levels[iter->depth - 1];
+    const struct textile_alignment *a = &level->alignment;
+    struct textile_hunk *conflict;
+    const char *text[3];
+    size_t lens[3], begin, total = 0;
+    int k;
+
+    for (k = 0; k != 3; ++k) {
+        begin = out_offset(&level->out, k, start + h->offset[k]);
+        text[k] = level->out.text[k] + begin;
+        lens[k] = out_offset(&level->out, k,
+                start + h->offset[k] + h->len[k]) - begin;
+        total += lens[k];
+    }
+
+    if (a->cascade && (!a->limit || total <= a->limit)) {
+        iter_push(iter, text, lens, a->flags);
+        return;
+    }
+
+    if (iter->holding)
+        iter->ready[iter->ready_count++] = iter->held;
+    iter->holding = false;
+
+    conflict = &iter->ready[iter->ready_count++];
+    memset(conflict, 0, sizeof *conflict);
+    conflict->kind = TEXTILE_HUNK_CONFLICT;
+    for (k = 0; k != 3; ++k) {
+        conflict->offset[k] = text[k] - iter->text[k];
+        conflict->len[k] = lens[k];
+    }
+}
+
+/*
+ * Takes the walk of the innermost level one step.  That level is done with
+ * once its walk runs out.
+ */
+static void
+iter_step(struct textile_merge_iter *iter)
+{
+    struct iter_level *level = &iter->levels[iter->depth - 1];
+    struct textile_alignment *a = &level->alignment;
+    struct textile_walk_step step;
+    const struct textile_hunk *h = &step.hunk;
+    int which;
+
+    if (a->whole >= 0) {
+        iter_merged(iter, a->whole, 0, a->len[a->whole]);
+        iter_pop(iter);
+        return;
+    }
+
+    if (!level->started) {
+        iter_merged(iter, MERGE_OURS, 0, a->prefix);
+        textile_walk_init(&level->walk, a);
+        level->started = true;
+        return;
+    }
+
+    if (!align_walk_next(&level->walk, a, &step)) {
+        iter_merged(iter, MERGE_OURS, a->len[MERGE_OURS] - a->suffix,
+                a->len[MERGE_OURS]);
+        iter_pop(iter);
+        return;
+    }
+
+    if (step.matched)
+        iter_merged(iter, MERGE_OURS, a->prefix + step.match,
+                a->prefix + step.match + 1);
+
+    if (!step.changed)
+        return;
+
+    if (h->kind == TEXTILE_HUNK_CONFLICT) {
+        iter_conflicted(iter, h, a->prefix);
+        return;
+    }
+
+    which = h->source;
+    iter_merged(iter, which, a->prefix + h->offset[which],
+            a->prefix + h->offset[which] + h->len[which]);
+}
+
+struct textile_merge_iter *
+textile_merge_begin(
+        const char *base, size_t base_len,
+        const char *ours, size_t ours_len,
+        const char *theirs, size_t theirs_len,
+        const struct textile_options *options)
+{
+    static const struct textile_options defaults = { 0 };
+    const size_t lens[3] = { base_len, ours_len, theirs_len };
+    struct textile_merge_iter *iter;
+
+    if (!options)
+        options = &defaults;
+
+    iter = ctx_calloc(options->ctx, 1, sizeof *iter);
+    if (!iter)
+        return NULL;
+
+    iter->options = *options;
+    iter->text[MERGE_BASE] = base;
+    iter->text[MERGE_OURS] = ours;
+    iter->text[MERGE_THEIRS] = theirs;
+
+    iter_push(iter, iter->text, lens, options->flags);
+
+    return iter;
+}
+
+bool
+textile_merge_next(struct textile_merge_iter *iter, struct textile_hunk *hunk)
+{
+    while (!iter->ready_count && iter->depth)
+        iter_step(iter);
+
+    if (!iter->ready_count && iter->holding) {
+        iter->ready[iter->ready_count++] = iter->held;
+        iter->holding = false;
+    }
+
+    if (!iter->ready_count)
+        return false;
+
+    *hunk = iter->ready[0];
+    iter->ready_count--;
+    memmove(iter->ready, iter->ready + 1,
+            iter->ready_count * sizeof *iter->ready);
+
+    if (hunk->kind == TEXTILE_HUNK_CONFLICT)
+        iter->conflicts_found = true;
+
+    return true;
+}
+
+bool
+textile_merge_conflicted(const struct textile_merge_iter *iter)
+{
+    return iter->conflicts_found;
+}
+
+void
+textile_merge_end(struct textile_merge_iter *iter)
+{
+    if (!iter)
+        return;
+
+    while (iter->depth)
+        iter_pop(iter);
+    ctx_free(iter->options.ctx, iter);
+}
+
+/*
+ * UTF-16
+ *
+ * The same merge over 16 bit code units.  The text handed around inside is
+ * still addressed in bytes, two to a unit, and only turned back into units on
+ * the way out.
+ */
+#define SYMBOL uint16_t
+#define SYMBOL_SIGNED int16_t
+#define SYMBOL_NAME(name) name##_u16
+#define SYMBOL_NEWLINE 0x000a
+#include "lcs_merge.h"
+#undef SYMBOL_NEWLINE
+#undef SYMBOL_NAME
+#undef SYMBOL_SIGNED
+#undef SYMBOL
+
+void
+textile_align_u16(const uint16_t *base, size_t base_len,
+                  const uint16_t *ours, size_t ours_len,
+                  const uint16_t *theirs, size_t theirs_len,
+                  const struct textile_options *options,
+                  struct textile_alignment *alignment)
+{
+    static const struct textile_options defaults = { 0 };
+    const size_t unit = sizeof (uint16_t);
+
+    if (!options)
+        options = &defaults;
+
+    memset(alignment, 0, sizeof *alignment);
+    alignment->whole = -1;
+    alignment->ctx = options->ctx;
+    alignment->len[MERGE_BASE] = base_len;
+    alignment->len[MERGE_OURS] = ours_len;
+    alignment->len[MERGE_THEIRS] = theirs_len;
+
+    if (same((const char *) ours, ours_len * unit,
+                (const char *) theirs, theirs_len * unit)
+            || same((const char *) base, base_len * unit,
+                (const char *) theirs, theirs_len * unit))
+        alignment->whole = MERGE_OURS;
+    else if (same((const char *) base, base_len * unit,
+                (const char *) ours, ours_len * unit))
+        alignment->whole = MERGE_THEIRS;
+    else
+        align_trimmed_u16(alignment, base, base_len, ours, ours_len,
+                theirs, theirs_len, options);
+}
+
+struct u16_out {
+    void (*merged)(void *, const uint16_t *, size_t);
+    void (*conflicted)(void *,
+        const uint16_t *, size_t,
+        const uint16_t *, size_t,
+        const uint16_t *, size_t);
+    void *data;
+};
+
+static void
+u16_merged(void *data, const struct textile_span *spans, size_t count)
+{
+    struct u16_out *u = data;
+    size_t k;
+
+    for (k = 0; k != count; ++k)
+        u->merged(u->data, (const uint16_t *) spans[k].text,
+                spans[k].len / sizeof (uint16_t));
+}
+
+static void
+u16_conflicted(void *data,
+               const char *base, size_t base_len,
+               const char *ours, size_t ours_len,
+               const char *theirs, size_t theirs_len)
+{
+    struct u16_out *u = data;
+
+    u->conflicted(u->data,
+            (const uint16_t *) base, base_len / sizeof (uint16_t),
+            (const uint16_t *) ours, ours_len / sizeof (uint16_t),
+            (const uint16_t *) theirs, theirs_len / sizeof (uint16_t));
+}
+
+bool
+textile_merge_u16(
+        const uint16_t *base, size_t base_len,
+        const uint16_t *ours, size_t ours_len,
+        const uint16_t *theirs, size_t theirs_len,
+        void (*merged)(void *, const uint16_t *, size_t),
+        void (*conflicted)(void *,
+            const uint16_t *, size_t,
+            const uint16_t *, size_t,
+            const uint16_t *, size_t),
+        void *data,
+        const struct textile_options *options)
+{
+    struct u16_out u = {
+        .merged = merged, .conflicted = conflicted, .data = data
+    };
+    struct out_buffer buffer = {
+        .merged = NULL, .merged_spans = u16_merged, .data = &u, .count = 0
+    };
+    struct merge_out out = {
+        .conflicted = u16_conflicted, .data = &u,
+        .text = {
+            (const char *) base, (const char *) ours, (const char *) theirs
+        },
+        .offsets = { NULL, NULL, NULL },
+        .unit = sizeof (uint16_t),
+        .buffer = &buffer
+    };
+    struct textile_alignment a;
+    bool conflicts_found = false;
+
+    textile_align_u16(base, base_len, ours, ours_len, theirs, theirs_len,
+            options, &a);
+    if (a.whole >= 0)
+        out_merged(&out, a.whole, 0, a.len[a.whole]);
+    else
+        conflicts_found = merge_walk_u16(&a, &out);
+    textile_alignment_free(&a);
+
+    out_flush(&out);
 
     return conflicts_found;
 }
@@ -19,6 +19,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,6 +48,8 @@ extern "C" {
  * conflicted sections.
  *
  * merged - Receives a single merged sequence.  Can be copied to output.
+ *          Merged sequences that follow each other in the same input are
+ *          handed over together in one call.
  * conflicted - Receives three sequences:  base, ours, theirs in that order.
  *              A section that could not be resolved.
  *
@@ -66,6 +69,351 @@ textile_merge(
             const char *, size_t),
         void *handlerData);
 
+/*
+ * Selects the algorithm used to find the LCS between base and each side.
+ *
+ * TEXTILE_ENGINE_AUTO - Let textile choose based on the size of the input.
+ * TEXTILE_ENGINE_TABLE - Always fill the full O(mn) table.  Finds the best
+ *                        grouping but takes memory for every pair of
+ *                        characters.
+ * TEXTILE_ENGINE_LINEAR - Hirschberg's linear space algorithm.
+ * TEXTILE_ENGINE_MYERS - Myers' O((m + n) D) algorithm.  Very fast when the
+ *                        number of differences, D, is small.
+ * TEXTILE_ENGINE_BITS - Bit-parallel O(mn) algorithm.  Computes 64 cells at a
+ *                       time with a bit per cell of memory.  Groups matches
+ *                       less well than the table.
+ * TEXTILE_ENGINE_BANDED - The table restricted to a band of diagonals which is
+ *                         doubled until the result is known to be the best.
+ *                         O((m + n) D) time and memory.
+ */
+enum textile_engine {
+    TEXTILE_ENGINE_AUTO = 0,
+    TEXTILE_ENGINE_TABLE,
+    TEXTILE_ENGINE_LINEAR,
+    TEXTILE_ENGINE_MYERS,
+    TEXTILE_ENGINE_BITS,
+    TEXTILE_ENGINE_BANDED
+};
+
+/*
+ * Flags for textile_options.
+ *
+ * TEXTILE_NO_SIMD - Don't use the vector instructions of the CPU.  The results
+ *                   are the same either way.
+ * TEXTILE_CONCURRENT - Compute the LCS of base with ours and with theirs at
+ *                      the same time.  The second one runs on a thread of its
+ *                      own or through the submit hook if one is given.  The
+ *                      results are the same either way.
+ * TEXTILE_TOKENS - Merge whole tokens rather than bytes: identifiers, numbers,
+ *                  runs of blanks, line breaks and single characters of
+ *                  punctuation.  Much faster on source code and changes to
+ *                  different words never get mixed up letter by letter.  The
+ *                  callbacks still get spans of the original bytes.
+ *                  TEXTILE_ENGINE_LINEAR and TEXTILE_ENGINE_BITS work on
+ *                  bytes only and are treated as TEXTILE_ENGINE_AUTO.
+ * TEXTILE_LINES - Merge whole lines first, as diff3 does, and then merge only
+ *                 the lines that conflict again by bytes, or by tokens with
+ *                 TEXTILE_TOKENS.  This is what makes whole files practical.
+ *                 Changes to neighbouring lines can still merge cleanly.
+ * TEXTILE_CASCADE - With TEXTILE_TOKENS, merge what still conflicts between
+ *                   tokens again by bytes.  Together with TEXTILE_LINES, each
+ *                   conflict goes from lines to tokens to bytes and each level
+ *                   only runs inside what the one before could not merge.
+ *                   Conflicts may then split words as they do with bytes.
+ */
+enum textile_flags {
+    TEXTILE_NO_SIMD = 1 << 0,
+    TEXTILE_CONCURRENT = 1 << 1,
+    TEXTILE_TOKENS = 1 << 2,
+    TEXTILE_LINES = 1 << 3,
+    TEXTILE_CASCADE = 1 << 4
+};
+
+/*
+ * An index of a base text that can be shared by many merges against it.
+ * Merges that find the base they are given within the index skip splitting
+ * and hashing its lines for each side and share other work on it.
+ *
+ * The index refers to base rather than copying it.  It must stay unchanged
+ * until the index is freed.  Returns NULL if memory runs out or base is
+ * empty.  An index may be used by several merges at the same time.
+ */
+struct textile_index;
+
+struct textile_index *
+textile_index_build(const char *base, size_t base_len);
+
+void
+textile_index_free(struct textile_index *index);
+
+/*
+ * Scratch memory that merges can reuse.  With a context in
+ * textile_options.ctx, the LCS tables and results are taken from buffers the
+ * context keeps and grows as needed instead of being allocated and freed by
+ * each merge.  That saves a lot when merging many small texts.
+ *
+ * A context may only be used by one merge at a time.  Keep one per thread.
+ *
+ * flags - TEXTILE_CTX_HUGE_PAGES asks for big buffers to be backed by huge
+ *         pages, where the system supports that and no allocator is given.
+ *
+ * Returns NULL if memory runs out.
+ */
+enum textile_ctx_flags {
+    TEXTILE_CTX_HUGE_PAGES = 1 << 0
+};
+
+struct textile_ctx;
+
+struct textile_ctx *
+textile_ctx_new(unsigned flags);
+
+/*
+ * Memory for a context and for every merge that uses it.
+ *
+ * alloc - Returns size bytes, suitably aligned for any type, or NULL.
+ * free - Gives back memory from alloc.  May be NULL, as for an arena that is
+ *        reset as a whole.
+ * data - Passed to both as is.
+ *
+ * With TEXTILE_CONCURRENT or more than one thread in the options, both are
+ * called from several threads at once.
+ */
+struct textile_allocator {
+    void *(*alloc)(void *data, size_t size);
+    void (*free)(void *data, void *p);
+    void *data;
+};
+
+/*
+ * Same as textile_ctx_new() but takes all memory from allocator, including
+ * the context itself.
+ */
+struct textile_ctx *
+textile_ctx_new_allocator(unsigned flags,
+                          const struct textile_allocator *allocator);
+
+/*
+ * Gives the buffers the context keeps between merges back to its allocator.
+ * Call it before resetting an arena the context allocates from.
+ */
+void
+textile_ctx_trim(struct textile_ctx *ctx);
+
+void
+textile_ctx_free(struct textile_ctx *ctx);
+
+/*
+ * A span of merged output.  Points into base, ours or theirs.
+ */
+struct textile_span {
+    const char *text;
+    size_t len;
+};
+
+/*
+ * Tuning for textile_merge_ex().  A zeroed struct selects the defaults.
+ *
+ * engine - The LCS algorithm to use.
+ * flags - Any of enum textile_flags or'd together.
+ * threads - How many threads may work on a single LCS table, including the
+ *           calling thread.  Zero and one both mean no extra threads.  The
+ *           results are the same either way.
+ * submit - Optional executor for TEXTILE_CONCURRENT.  Should arrange for
+ *          task(arg) to be called once, on any thread, and return zero.  If it
+ *          returns anything else, the task is run on the calling thread.  The
+ *          caller of textile_merge_ex() waits for the task before returning.
+ * executor_data - Passed to submit as is.
+ * index - Optional index built by textile_index_build() over the same base
+ *         buffer passed to textile_merge_ex().  Ignored if it is for another
+ *         buffer.
+ * ctx - Optional context from textile_ctx_new() to take scratch memory from.
+ * merged_spans - Optional.  Receives merged output in batches of spans
+ *                instead of the merged callback, which may then be NULL.  A
+ *                batch always comes before the conflict that follows it.
+ * max_memory - Bytes that finding one LCS may take beyond what is linear in
+ *              the input.  Engines are picked to stay within it and
+ *              anything past it goes to engines that are linear in memory.
+ *              Zero means 16MB.  If memory runs out anyway, the next engine
+ *              down is tried rather than giving up on the LCS.
+ * engines_used - Optional.  Gets 1 << engine or'd in for each engine that
+ *                found an LCS, or part of one, during the merge.  Useful to
+ *                check what a budget led to.  It is not cleared first.
+ * token_limit - The longest conflict between lines, counting base and both
+ *               sides, that is merged again by tokens.  Longer ones are
+ *               reported as they are.  Zero means no limit.
+ * byte_limit - The same for merging again by bytes, whether the conflict was
+ *              found between lines or between tokens.
+ * threads_used - Optional.  Raised to the most threads that filled one table
+ *                together during the merge.  Tables too small to be worth
+ *                splitting are filled by the calling thread alone and don't
+ *                count.  It is not cleared first.
+ */
+struct textile_options {
+    enum textile_engine engine;
+    unsigned flags;
+    unsigned threads;
+
+    int (*submit)(void *executor_data, void (*task)(void *), void *arg);
+    void *executor_data;
+
+    struct textile_index *index;
+    struct textile_ctx *ctx;
+
+    void (*merged_spans)(void *handlerData,
+            const struct textile_span *spans, size_t count);
+
+    size_t max_memory;
+    unsigned *engines_used;
+
+    size_t token_limit;
+    size_t byte_limit;
+
+    unsigned *threads_used;
+};
+
+/*
+ * Same as textile_merge() but takes options.  Passing NULL for options is the
+ * same as calling textile_merge().
+ */
+bool
+textile_merge_ex(
+        const char *base, size_t base_len,
+        const char *ours, size_t ours_len,
+        const char *theirs, size_t theirs_len,
+        void (*merged)(void *, const char *, size_t),
+        void (*conflicted)(void *,
+            const char *, size_t,
+            const char *, size_t,
+            const char *, size_t),
+        void *handlerData,
+        const struct textile_options *options);
+
+/*
+ * Conflict markers for textile_merge_to_buffer().  A conflict is written as
+ * ours, our side, base, the base, theirs, their side, then end.  Without a
+ * base marker, the base is left out.  Passing NULL for the whole struct
+ * selects "<<<<<<<", "|||||||", "=======" and ">>>>>>>".
+ */
+struct textile_markers {
+    const char *ours;
+    const char *base;
+    const char *theirs;
+    const char *end;
+};
+
+/*
+ * Returns a size that the output of textile_merge_to_buffer() never exceeds
+ * for inputs of these lengths, or SIZE_MAX if that doesn't fit in a size_t.
+ */
+size_t
+textile_merge_bound(size_t base_len, size_t ours_len, size_t theirs_len,
+                    const struct textile_markers *markers);
+
+/*
+ * Same as textile_merge_ex() but writes the merged result, with conflicts
+ * between markers, to buffer instead of calling back.  The length of the
+ * result goes in *length.  If that is more than size, only the first size
+ * bytes are written.  A buffer of textile_merge_bound() bytes is always big
+ * enough.  options may be NULL.
+ */
+bool
+textile_merge_to_buffer(
+        const char *base, size_t base_len,
+        const char *ours, size_t ours_len,
+        const char *theirs, size_t theirs_len,
+        char *buffer, size_t size, size_t *length,
+        const struct textile_markers *markers,
+        const struct textile_options *options);
+
+/*
+ * A piece of the result of a merge, described by where it is in the inputs.
+ *
+ * kind - TEXTILE_HUNK_MERGED for text to copy out of one input or
+ *        TEXTILE_HUNK_CONFLICT for a section that could not be resolved.
+ * source - The input a merged hunk comes from.
+ * offset, len - Where the hunk is in each input, indexed by enum
+ *               textile_source.  A merged hunk only sets its source.
+ */
+enum textile_hunk_kind {
+    TEXTILE_HUNK_MERGED,
+    TEXTILE_HUNK_CONFLICT
+};
+
+enum textile_source {
+    TEXTILE_SOURCE_BASE,
+    TEXTILE_SOURCE_OURS,
+    TEXTILE_SOURCE_THEIRS
+};
+
+struct textile_hunk {
+    enum textile_hunk_kind kind;
+    enum textile_source source;
+    size_t offset[3];
+    size_t len[3];
+};
+
+/*
+ * Merges the same way as textile_merge_ex() but hands the result out a hunk at
+ * a time to whoever asks with textile_merge_next().  The hunks are plain data
+ * that may go to other threads.
+ *
+ * textile_merge_begin() finds the LCS of base with each side and each call to
+ * textile_merge_next() walks them only as far as the next hunk.  Conflicts
+ * that options ask to merge again, by tokens or bytes, are merged when the
+ * walk gets to them.  So stopping early skips the rest of the work.  The
+ * inputs, and whatever options points to, must stay until
+ * textile_merge_end().  Memory comes from the context in options, if any.
+ *
+ * Returns NULL if memory runs out.
+ */
+struct textile_merge_iter;
+
+struct textile_merge_iter *
+textile_merge_begin(
+        const char *base, size_t base_len,
+        const char *ours, size_t ours_len,
+        const char *theirs, size_t theirs_len,
+        const struct textile_options *options);
+
+/*
+ * Fills in hunk with the next piece of the result.  Returns false, leaving
+ * hunk alone, once there are no more.
+ */
+bool
+textile_merge_next(struct textile_merge_iter *iter, struct textile_hunk *hunk);
+
+/*
+ * Returns true if any hunk handed out by iter so far is a conflict.  Once
+ * textile_merge_next() returns false, that says whether the merge had any.
+ */
+bool
+textile_merge_conflicted(const struct textile_merge_iter *iter);
+
+/*
+ * Frees iter.  It does not need to have been run to the end.
+ */
+void
+textile_merge_end(struct textile_merge_iter *iter);
+
+/*
+ * Same as textile_merge_ex() but merges UTF-16 text a code unit at a time.
+ * Lengths, in and out, count units.  TEXTILE_LINES, TEXTILE_TOKENS and the
+ * index and merged_spans in options only apply to bytes and are ignored.
+ */
+bool
+textile_merge_u16(
+        const uint16_t *base, size_t base_len,
+        const uint16_t *ours, size_t ours_len,
+        const uint16_t *theirs, size_t theirs_len,
+        void (*merged)(void *, const uint16_t *, size_t),
+        void (*conflicted)(void *,
+            const uint16_t *, size_t,
+            const uint16_t *, size_t,
+            const uint16_t *, size_t),
+        void *handlerData,
+        const struct textile_options *options);
+
 #ifdef __cplusplus
 }
 #endif
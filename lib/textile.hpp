@@ -0,0 +1,326 @@
+/**
+ * © Copyright 2013 Carl N. Baldwin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TEXTILE_HPP
+#define _TEXTILE_HPP
+
+#include "textile.h"
+#include "textile_generator.hpp"
+#include "textile_walk.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace textile {
+
+namespace detail {
+
+/* The walk for each type of symbol, as lcs_merge.h has it. */
+#define WALK_SYMBOL char
+#define WALK_NAME(name) name
+#include "textile_walk.h"
+#undef WALK_NAME
+#undef WALK_SYMBOL
+
+#define WALK_SYMBOL uint16_t
+#define WALK_NAME(name) name##_u16
+#include "textile_walk.h"
+#undef WALK_NAME
+#undef WALK_SYMBOL
+
+#define WALK_SYMBOL uint32_t
+#define WALK_NAME(name) name##_u32
+#include "textile_walk.h"
+#undef WALK_NAME
+#undef WALK_SYMBOL
+
+/*
+ * One level of a merge from textile_align(), freed when it goes out of scope.
+ */
+class alignment {
+public:
+    alignment(std::string_view base, std::string_view ours,
+              std::string_view theirs, const struct textile_options *options) {
+        textile_align(base.data(), base.size(), ours.data(), ours.size(),
+                      theirs.data(), theirs.size(), options, &a);
+    }
+
+    alignment(std::u16string_view base, std::u16string_view ours,
+              std::u16string_view theirs,
+              const struct textile_options *options) {
+        textile_align_u16(
+                reinterpret_cast<const uint16_t *>(base.data()), base.size(),
+                reinterpret_cast<const uint16_t *>(ours.data()), ours.size(),
+                reinterpret_cast<const uint16_t *>(theirs.data()),
+                theirs.size(), options, &a);
+    }
+
+    alignment(const alignment &) = delete;
+    alignment &operator=(const alignment &) = delete;
+
+    ~alignment() { textile_alignment_free(&a); }
+
+    struct textile_alignment a;
+};
+
+/*
+ * Takes the walk over a, of Symbol, one step.
+ */
+template <typename Symbol>
+inline bool
+walk_next(struct textile_walk *w, const struct textile_alignment *a,
+          struct textile_walk_step *step)
+{
+    if constexpr (std::is_same_v<Symbol, uint32_t>)
+        return textile_walk_next_u32(w, a, step);
+    else if constexpr (std::is_same_v<Symbol, uint16_t>)
+        return textile_walk_next_u16(w, a, step);
+    else
+        return textile_walk_next(w, a, step);
+}
+
+/*
+ * Where a level hands what its walk finds.  A merged span is held back while
+ * the next one carries on from it in the same input, as textile_merge_ex()
+ * joins them, and handed over before a conflict and at the end of the level.
+ */
+template <typename View, typename Merged, typename Conflicted>
+struct out {
+    Merged &merged;
+    Conflicted &conflicted;
+    View text[3];
+    const size_t *offsets[3];
+
+    View held;
+    int held_source;
+
+    size_t offset(int which, size_t k) const {
+        return offsets[which] ? offsets[which][k] : k;
+    }
+
+    View slice(int which, size_t begin, size_t end) const {
+        begin = offset(which, begin);
+        return text[which].substr(begin, offset(which, end) - begin);
+    }
+
+    void flush() {
+        if (!held.empty())
+            merged(held);
+        held = View();
+    }
+
+    void merge(int which, size_t begin, size_t end) {
+        View span = slice(which, begin, end);
+
+        if (span.empty())
+            return;
+        if (held_source == which
+                && held.data() + held.size() == span.data()) {
+            held = View(held.data(), held.size() + span.size());
+            return;
+        }
+        flush();
+        held = span;
+        held_source = which;
+    }
+};
+
+template <typename View, typename Merged, typename Conflicted>
+bool
+merge_level(View base, View ours, View theirs, Merged &merged,
+            Conflicted &conflicted, const struct textile_options &options);
+
+/*
+ * Walks a, of Symbol, into o.  A conflict is merged again with the flags of
+ * the next finer level when a says so.  Returns true if conflicts occurred.
+ */
+template <typename Symbol, typename View, typename Merged,
+          typename Conflicted>
+bool
+walk(const struct textile_alignment &a, out<View, Merged, Conflicted> &o,
+     const struct textile_options &options)
+{
+    const int BASE = TEXTILE_SOURCE_BASE, OURS = TEXTILE_SOURCE_OURS,
+              THEIRS = TEXTILE_SOURCE_THEIRS;
+    struct textile_walk w;
+    struct textile_walk_step step;
+    const struct textile_hunk &h = step.hunk;
+    struct textile_options finer;
+    View base, ours, theirs;
+    size_t start = a.prefix;
+    bool conflicts_found = false;
+
+    o.merge(OURS, 0, a.prefix);
+
+    textile_walk_init(&w, &a);
+    while (walk_next<Symbol>(&w, &a, &step)) {
+        if (step.matched)
+            o.merge(OURS, start + step.match, start + step.match + 1);
+        if (!step.changed)
+            continue;
+
+        if (h.kind == TEXTILE_HUNK_MERGED) {
+            o.merge(h.source, start + h.offset[h.source],
+                    start + h.offset[h.source] + h.len[h.source]);
+            continue;
+        }
+
+        base = o.slice(BASE, start + h.offset[BASE],
+                    start + h.offset[BASE] + h.len[BASE]);
+        ours = o.slice(OURS, start + h.offset[OURS],
+                       start + h.offset[OURS] + h.len[OURS]);
+        theirs = o.slice(THEIRS, start + h.offset[THEIRS],
+                         start + h.offset[THEIRS] + h.len[THEIRS]);
+        o.flush();
+
+        if (a.cascade && (!a.limit
+                    || base.size() + ours.size() + theirs.size() <= a.limit)) {
+            finer = options;
+            finer.flags = a.flags;
+            if (merge_level(base, ours, theirs, o.merged, o.conflicted, finer))
+                conflicts_found = true;
+        } else {
+            o.conflicted(base, ours, theirs);
+            conflicts_found = true;
+        }
+    }
+
+    o.merge(OURS, a.len[OURS] - a.suffix, a.len[OURS]);
+
+    return conflicts_found;
+}
+
+/*
+ * Merges one level, and whatever it cascades to, as textile_merge_ex() would.
+ */
+template <typename View, typename Merged, typename Conflicted>
+bool
+merge_level(View base, View ours, View theirs, Merged &merged,
+            Conflicted &conflicted, const struct textile_options &options)
+{
+    alignment level(base, ours, theirs, &options);
+    const struct textile_alignment &a = level.a;
+    out<View, Merged, Conflicted> o = {
+        merged, conflicted, { base, ours, theirs },
+        { a.offsets[0], a.offsets[1], a.offsets[2] }, View(), -1
+    };
+    bool conflicts_found = false;
+
+    if (a.whole >= 0)
+        o.merge(a.whole, 0, a.len[a.whole]);
+    else if (a.size == sizeof (uint32_t))
+        conflicts_found = walk<uint32_t>(a, o, options);
+    else if (a.size == sizeof (uint16_t))
+        conflicts_found = walk<uint16_t>(a, o, options);
+    else
+        conflicts_found = walk<char>(a, o, options);
+
+    o.flush();
+
+    return conflicts_found;
+}
+
+}  // namespace detail
+
+/*
+ * C++ face of textile_merge_ex().  merged is called with a std::string_view
+ * of each merged span and conflicted with views of base, ours and theirs.
+ * Both can be any callable, lambdas included.
+ *
+ * The library only finds the LCS.  The walk over it is compiled here from
+ * textile_walk.h for each pair of callables, which are called directly from
+ * it and so can be inlined.  An exception thrown by either stops the merge
+ * and goes on to the caller.
+ *
+ * Returns true if conflicts occurred.
+ */
+template <typename Merged, typename Conflicted>
+bool
+merge(std::string_view base, std::string_view ours, std::string_view theirs,
+      Merged &&merged, Conflicted &&conflicted,
+      const struct textile_options *options = nullptr)
+{
+    struct textile_options copy = {};
+
+    if (options)
+        copy = *options;
+
+    return detail::merge_level(base, ours, theirs, merged, conflicted, copy);
+}
+
+/*
+ * Same as above for UTF-16 text, merged a code unit at a time as
+ * textile_merge_u16() does.
+ */
+template <typename Merged, typename Conflicted>
+bool
+merge(std::u16string_view base, std::u16string_view ours,
+      std::u16string_view theirs, Merged &&merged, Conflicted &&conflicted,
+      const struct textile_options *options = nullptr)
+{
+    struct textile_options copy = {};
+
+    if (options)
+        copy = *options;
+
+    return detail::merge_level(base, ours, theirs, merged, conflicted, copy);
+}
+
+/*
+ * Returns the merged result with conflicts between markers, laid out as
+ * textile_merge_to_buffer() would.  conflicts, if given, is set to whether
+ * there were any.
+ */
+inline std::string
+merge_to_string(std::string_view base, std::string_view ours,
+                std::string_view theirs, bool *conflicts = nullptr,
+                const struct textile_markers *markers = nullptr,
+                const struct textile_options *options = nullptr)
+{
+    static const struct textile_markers defaults = {
+        "<<<<<<<", "|||||||", "=======", ">>>>>>>"
+    };
+    std::string result;
+    bool conflicts_found;
+
+    if (!markers)
+        markers = &defaults;
+    result.reserve(ours.size());
+
+    conflicts_found = merge(base, ours, theirs,
+        [&](std::string_view text) { result += text; },
+        [&](std::string_view b, std::string_view o, std::string_view t) {
+            result += markers->ours;
+            result += o;
+            if (markers->base) {
+                result += markers->base;
+                result += b;
+            }
+            result += markers->theirs;
+            result += t;
+            result += markers->end;
+        }, options);
+    if (conflicts)
+        *conflicts = conflicts_found;
+
+    return result;
+}
+
+}  // namespace textile
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * © Copyright 2013 Carl N. Baldwin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TEXTILE_GENERATOR_HPP
+#define _TEXTILE_GENERATOR_HPP
+
+#include "textile.h"
+
+#if __cplusplus >= 202002L
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <new>
+#include <string_view>
+#include <utility>
+
+namespace textile {
+
+/*
+ * A generator of T that yields from a coroutine.  Only as much of the
+ * coroutine runs as it takes to produce each value asked for.
+ */
+template <typename T>
+class generator {
+public:
+    struct promise_type {
+        const T *value = nullptr;
+        std::exception_ptr exception;
+
+        generator get_return_object() {
+            return generator(handle::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const T &v) noexcept {
+            value = &v;
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    using handle = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        iterator() = default;
+        explicit iterator(handle h) : h_(h) {}
+
+        reference operator*() const { return *h_.promise().value; }
+        pointer operator->() const { return h_.promise().value; }
+
+        iterator &operator++() {
+            h_.resume();
+            check();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(std::default_sentinel_t) const {
+            return !h_ || h_.done();
+        }
+
+        void check() const {
+            if (h_.done() && h_.promise().exception)
+                std::rethrow_exception(h_.promise().exception);
+        }
+
+    private:
+        handle h_;
+    };
+
+    generator(generator &&other) noexcept
+        : h_(std::exchange(other.h_, nullptr)) {}
+    generator &operator=(generator &&other) noexcept {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    ~generator() {
+        if (h_)
+            h_.destroy();
+    }
+
+    /*
+     * Starts the coroutine.  Call once.
+     */
+    iterator begin() {
+        iterator it(h_);
+        h_.resume();
+        it.check();
+        return it;
+    }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+private:
+    explicit generator(handle h) : h_(h) {}
+
+    handle h_;
+};
+
+/*
+ * A hunk from textile_merge_next() with the text it refers to.  A merged hunk
+ * has only text.  A conflict has base, ours and theirs.
+ */
+struct hunk {
+    enum textile_hunk_kind kind;
+    std::string_view text;
+    std::string_view base, ours, theirs;
+};
+
+/*
+ * Yields the hunks of the merge of the three.  Leaving the loop early frees
+ * the iterator.  Throws std::bad_alloc if memory runs out.
+ */
+inline generator<hunk>
+hunks(std::string_view base, std::string_view ours, std::string_view theirs,
+      const struct textile_options *options = nullptr)
+{
+    struct iter_guard {
+        struct textile_merge_iter *iter;
+        ~iter_guard() { textile_merge_end(iter); }
+    } guard = {
+        textile_merge_begin(base.data(), base.size(),
+                            ours.data(), ours.size(),
+                            theirs.data(), theirs.size(), options)
+    };
+    const std::string_view text[3] = { base, ours, theirs };
+    struct textile_hunk h;
+
+    if (!guard.iter)
+        throw std::bad_alloc();
+
+    while (textile_merge_next(guard.iter, &h)) {
+        hunk out = {};
+
+        out.kind = h.kind;
+        if (h.kind == TEXTILE_HUNK_MERGED) {
+            out.text = text[h.source].substr(h.offset[h.source],
+                                             h.len[h.source]);
+        } else {
+            out.base = text[TEXTILE_SOURCE_BASE].substr(
+                    h.offset[TEXTILE_SOURCE_BASE], h.len[TEXTILE_SOURCE_BASE]);
+            out.ours = text[TEXTILE_SOURCE_OURS].substr(
+                    h.offset[TEXTILE_SOURCE_OURS], h.len[TEXTILE_SOURCE_OURS]);
+            out.theirs = text[TEXTILE_SOURCE_THEIRS].substr(
+                    h.offset[TEXTILE_SOURCE_THEIRS],
+                    h.len[TEXTILE_SOURCE_THEIRS]);
+        }
+        co_yield out;
+    }
+}
+
+}  // namespace textile
+
+#endif
+
+#endif
@@ -0,0 +1,404 @@
+/**
+ * © Copyright 2013 Carl N. Baldwin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The walk over the LCS of base with each side that makes the merge.
+ *
+ * textile_align() finds the LCS.  The walk over them is here rather than in
+ * the library so that whoever drives it gets it compiled into their own code.
+ * The library walks with the callbacks of textile_merge_ex() and textile.hpp
+ * walks with the callables it is given, which are then inlined into it.
+ *
+ * The first part, types and all, is only read once.  The rest is a template
+ * for each type of symbol, as lcs_table.h is, that is read each time it is
+ * included with the following defined:
+ *
+ * WALK_SYMBOL - Type of the symbols.
+ * WALK_NAME(name) - name with a suffix for the type of symbol.
+ */
+
+#ifndef _TEXTILE_WALK_H
+#define _TEXTILE_WALK_H
+
+#include "textile.h"
+
+#include <assert.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Symbol i of base is the same as symbol j of one side.
+ */
+struct textile_match {
+    size_t i;
+    size_t j;
+};
+
+/*
+ * The LCS of base with one side as its matches in order.
+ */
+struct textile_lcs {
+    struct textile_match *matches;
+    size_t len;
+};
+
+/*
+ * One level of a merge worked out as far as the walk over it.
+ *
+ * whole - The input that is the whole result when two of the three are the
+ *         same, else -1.  Nothing else is set then but len.
+ * symbols, len - The symbols of base, ours and theirs and how many there are.
+ *                Each is size bytes: 1 for bytes, 2 for UTF-16 code units and
+ *                4 for the IDs of lines or tokens.
+ * offsets - Where each line or token starts in its text, with one more for
+ *           the end.  NULL for bytes and code units.
+ * prefix, suffix - How many symbols all three start and end with that are left
+ *                  out of the LCS.
+ * src, dest - The LCS of base with theirs and with ours in between.
+ * cascade - Whether conflicts of at most limit bytes, counting base and both
+ *           sides, are to be merged again with flags.  Zero means no limit.
+ * ctx, ids - For textile_alignment_free().
+ */
+struct textile_alignment {
+    int whole;
+
+    const void *symbols[3];
+    size_t len[3];
+    size_t size;
+    size_t *offsets[3];
+
+    size_t prefix;
+    size_t suffix;
+    struct textile_lcs src;
+    struct textile_lcs dest;
+
+    bool cascade;
+    unsigned flags;
+    size_t limit;
+
+    struct textile_ctx *ctx;
+    uint32_t *ids[3];
+};
+
+/*
+ * Works out the coarsest level of the merge that options ask for, as
+ * textile_merge_ex() would, into alignment.  options may be NULL.  It refers
+ * to the inputs, which must stay until it is freed.  If memory runs out, a
+ * level falls back to the next finer one or to having no LCS at all.
+ */
+void
+textile_align(const char *base, size_t base_len,
+              const char *ours, size_t ours_len,
+              const char *theirs, size_t theirs_len,
+              const struct textile_options *options,
+              struct textile_alignment *alignment);
+
+/*
+ * Same as textile_align() for UTF-16 text, a code unit at a time.
+ */
+void
+textile_align_u16(const uint16_t *base, size_t base_len,
+                  const uint16_t *ours, size_t ours_len,
+                  const uint16_t *theirs, size_t theirs_len,
+                  const struct textile_options *options,
+                  struct textile_alignment *alignment);
+
+void
+textile_alignment_free(struct textile_alignment *alignment);
+
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * Follows an LCS from one match to the next.  The i and j ranges run from
+ * the match before, or the start, to the next match, or the end.
+ */
+struct textile_cursor {
+    size_t index;
+    size_t begin_index;
+
+    size_t i_len;
+    size_t i_begin;
+    size_t i_end;
+
+    size_t j_len;
+    size_t j_begin;
+    size_t j_end;
+
+    const struct textile_lcs *str;
+};
+
+static inline void
+textile_cursor_init(struct textile_cursor *c, const struct textile_lcs *str,
+                    size_t i_len, size_t j_len)
+{
+    c->index = 0;
+    c->begin_index = 0;
+    c->i_begin = 0;
+    c->j_begin = 0;
+    c->i_len = i_len;
+    c->j_len = j_len;
+    c->str = str;
+
+    if (c->index == c->str->len) {
+        c->i_end = c->i_len;
+        c->j_end = c->j_len;
+    } else {
+        c->i_end = c->str->matches[c->index].i;
+        c->j_end = c->str->matches[c->index].j;
+    }
+}
+
+static inline void
+textile_cursor_advance(struct textile_cursor *c, bool advance_begin)
+{
+    c->index++;
+
+    if (advance_begin) {
+        c->begin_index = c->index;
+        c->i_begin = c->i_end;
+        c->j_begin = c->j_end;
+    }
+
+    if (c->index >= c->str->len) {
+        c->i_end = c->i_len;
+        c->j_end = c->j_len;
+    } else {
+        c->i_end = c->str->matches[c->index].i;
+        c->j_end = c->str->matches[c->index].j;
+    }
+}
+
+/*
+ * How far the walk over the LCS of base with each side has got.  src follows
+ * the LCS with theirs and dest the one with ours.  Each step takes both to
+ * the next symbol that matches in all three.
+ */
+struct textile_walk {
+    struct textile_cursor src;
+    struct textile_cursor dest;
+};
+
+/*
+ * What one step of the walk found, counting symbols from the end of the
+ * prefix.  If matched, the step starts at a symbol common to all three, which
+ * is symbol match of ours.  If changed, what follows up to the next such
+ * symbol is hunk: merged from one input or a conflict.
+ */
+struct textile_walk_step {
+    bool matched;
+    size_t match;
+    bool changed;
+    struct textile_hunk hunk;
+};
+
+/*
+ * Starts a walk over the part of a between its prefix and suffix.
+ */
+static inline void
+textile_walk_init(struct textile_walk *w, const struct textile_alignment *a)
+{
+    size_t base_len = a->len[TEXTILE_SOURCE_BASE] - a->prefix - a->suffix;
+
+    textile_cursor_init(&w->src, &a->src, base_len,
+            a->len[TEXTILE_SOURCE_THEIRS] - a->prefix - a->suffix);
+    textile_cursor_init(&w->dest, &a->dest, base_len,
+            a->len[TEXTILE_SOURCE_OURS] - a->prefix - a->suffix);
+}
+
+#endif
+
+#ifdef WALK_SYMBOL
+
+/*
+ * Works out what to make of a group of changes that the cursors bracket.
+ */
+static inline void
+WALK_NAME(textile_walk_change)(const struct textile_cursor *src,
+                               const struct textile_cursor *dest,
+                               const WALK_SYMBOL *base,
+                               const WALK_SYMBOL *ours,
+                               const WALK_SYMBOL *theirs,
+                               struct textile_walk_step *step)
+{
+    struct textile_hunk *h = &step->hunk;
+    bool equal;
+
+    /*
+     * Three cases here are considered below.
+     *
+     * 1. Only changed in ours.
+     * 2. Only changed in theirs.
+     * 3. Changed identically in ours and theirs.
+     *
+     * Everything else is a conflict.
+     */
+    memset(h, 0, sizeof *h);
+    step->changed = true;
+    h->kind = TEXTILE_HUNK_MERGED;
+
+    if (src->i_end - src->i_begin == src->j_end - src->j_begin) {
+        equal = ! memcmp(
+                base + src->i_begin,
+                theirs + src->j_begin,
+                (src->i_end - src->i_begin) * sizeof (WALK_SYMBOL)
+                );
+        if (equal) {
+            /* theirs is the same as base.  Take ours. */
+            h->source = TEXTILE_SOURCE_OURS;
+            h->offset[TEXTILE_SOURCE_OURS] = dest->j_begin;
+            h->len[TEXTILE_SOURCE_OURS] = dest->j_end - dest->j_begin;
+            return;
+        }
+    }
+
+    if (dest->i_end - dest->i_begin == dest->j_end - dest->j_begin) {
+        equal = ! memcmp(
+                base + dest->i_begin,
+                ours + dest->j_begin,
+                (dest->i_end - dest->i_begin) * sizeof (WALK_SYMBOL)
+                );
+        if (equal) {
+            /* ours is the same as base.  Take theirs. */
+            h->source = TEXTILE_SOURCE_THEIRS;
+            h->offset[TEXTILE_SOURCE_THEIRS] = src->j_begin;
+            h->len[TEXTILE_SOURCE_THEIRS] = src->j_end - src->j_begin;
+            return;
+        }
+    }
+
+    if (src->j_end - src->j_begin == dest->j_end - dest->j_begin) {
+        equal = ! memcmp(
+                theirs + src->j_begin,
+                ours + dest->j_begin,
+                (dest->j_end - dest->j_begin) * sizeof (WALK_SYMBOL)
+                );
+        if (equal) {
+            /* ours is the same as theirs.  Take ours. */
+            h->source = TEXTILE_SOURCE_OURS;
+            h->offset[TEXTILE_SOURCE_OURS] = dest->j_begin;
+            h->len[TEXTILE_SOURCE_OURS] = dest->j_end - dest->j_begin;
+            return;
+        }
+    }
+
+    h->kind = TEXTILE_HUNK_CONFLICT;
+    h->offset[TEXTILE_SOURCE_BASE] = dest->i_begin;
+    h->len[TEXTILE_SOURCE_BASE] = dest->i_end - dest->i_begin;
+    h->offset[TEXTILE_SOURCE_OURS] = dest->j_begin;
+    h->len[TEXTILE_SOURCE_OURS] = dest->j_end - dest->j_begin;
+    h->offset[TEXTILE_SOURCE_THEIRS] = src->j_begin;
+    h->len[TEXTILE_SOURCE_THEIRS] = src->j_end - src->j_begin;
+}
+
+/*
+ * Takes the walk over a one step.  Returns false, leaving step alone, once
+ * there are no more.
+ */
+static inline bool
+WALK_NAME(textile_walk_next)(struct textile_walk *w,
+                             const struct textile_alignment *a,
+                             struct textile_walk_step *step)
+{
+    const WALK_SYMBOL *base =
+        (const WALK_SYMBOL *) a->symbols[TEXTILE_SOURCE_BASE] + a->prefix;
+    const WALK_SYMBOL *ours =
+        (const WALK_SYMBOL *) a->symbols[TEXTILE_SOURCE_OURS] + a->prefix;
+    const WALK_SYMBOL *theirs =
+        (const WALK_SYMBOL *) a->symbols[TEXTILE_SOURCE_THEIRS] + a->prefix;
+    struct textile_cursor *src = &w->src, *dest = &w->dest;
+    bool only_deletes;
+    size_t old_end;
+
+    if (src->index > src->str->len || dest->index > dest->str->len)
+        return false;
+
+    assert(src->i_begin == dest->i_begin);
+
+    /**
+     * Each step sets begin to point to a "character" that matches in all
+     * three files.  The first step is special in that the matching
+     * "character" is the beginning of the sequence (like ^ in a regular
+     * expression.)  It has zero length.
+     */
+
+    step->matched = src->index != 0;
+    step->changed = false;
+    if (step->matched) {
+        step->match = dest->j_begin;
+        dest->j_begin++;
+        dest->i_begin++;
+        src->j_begin++;
+        src->i_begin++;
+    }
+
+    only_deletes = true;
+    if (0 != (src->j_end - src->j_begin))
+        only_deletes = false;
+    if (0 != (dest->j_end - dest->j_begin))
+        only_deletes = false;
+
+    /*
+     * Find an end that matches in all three files.  Do this by advancing
+     * whichever cursor trails in the base file until both cursors point to the
+     * same position in the base file.
+     *
+     * Always guaranteed to find a matching end since EOF will match.  Note
+     * that this always finds the first such position relative to where the
+     * begins were set above.
+     */
+    while(src->i_end != dest->i_end) {
+        if(src->i_end < dest->i_end) {
+            old_end = src->j_end;
+            textile_cursor_advance(src, false);
+            if (1 != (src->j_end - old_end))
+                only_deletes = false;
+        } else {
+            old_end = dest->j_end;
+            textile_cursor_advance(dest, false);
+            if (1 != (dest->j_end - old_end))
+                only_deletes = false;
+        }
+    }
+
+    /*
+     * i_begin and i_end in each cursor bracket an area where changes have been
+     * made in ours, theirs or both.  It is tight in the sense that there are
+     * no characters within the bounds that match in all three.  Hence, it is
+     * not possible to find a smaller subset of changes that are bound by a
+     * character common to all three.
+     */
+
+    assert(src->i_end == dest->i_end);
+
+    /*
+     * Optimize cases where all of the current group of changes are deletes in
+     * either ours, theirs or both.
+     */
+    if (!only_deletes)
+        WALK_NAME(textile_walk_change)(src, dest, base, ours, theirs, step);
+
+    textile_cursor_advance(src, true);
+    textile_cursor_advance(dest, true);
+
+    return true;
+}
+
+#endif
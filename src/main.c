@@ -16,5 +16,285 @@
 
 #include "textile.h"
 
-int main() {
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * textile BASE OURS THEIRS [MERGED]
+ *
+ * Merges the three files and writes the result to MERGED, or to standard
+ * output without it.  The exit status is 0 for a clean merge, 1 if there were
+ * conflicts and 2 for trouble, like diff3.
+ *
+ * The inputs are mapped into memory and the result is written as a list of
+ * slices of them, with the conflict markers in between, in as few writev()
+ * calls as it takes.  The merged content is never copied here.
+ */
+
+struct input {
+    const char *name;
+    char *text;
+    size_t len;
+    bool mapped;
+};
+
+static bool
+input_open(struct input *in, const char *name)
+{
+    struct stat st;
+    size_t capacity = 0;
+    ssize_t n;
+    int fd;
+
+    in->name = name;
+    in->text = NULL;
+    in->len = 0;
+    in->mapped = false;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        in->text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in->text != MAP_FAILED) {
+            in->len = st.st_size;
+            in->mapped = true;
+            close(fd);
+            return true;
+        }
+        in->text = NULL;
+    }
+
+    /* Pipes and the like are read in instead. */
+    for (;;) {
+        if (in->len == capacity) {
+            char *text;
+
+            capacity = capacity ? 2 * capacity : 65536;
+            text = realloc(in->text, capacity);
+            if (!text) {
+                errno = ENOMEM;
+                break;
+            }
+            in->text = text;
+        }
+        n = read(fd, in->text + in->len, capacity - in->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                break;
+            close(fd);
+            return true;
+        }
+        in->len += n;
+    }
+
+    n = errno;
+    close(fd);
+    free(in->text);
+    in->text = NULL;
+    errno = n;
+    return false;
+}
+
+static void
+input_close(struct input *in)
+{
+    if (in->mapped)
+        munmap(in->text, in->len);
+    else
+        free(in->text);
+}
+
+/* Conflict markers are the only bytes that aren't in the inputs. */
+static char ours_marker[] = "<<<<<<<";
+static char base_marker[] = "|||||||";
+static char theirs_marker[] = "=======";
+static char end_marker[] = ">>>>>>>";
+
+struct output {
+    struct iovec *iov;
+    size_t count;
+    size_t capacity;
+    bool failed;
+};
+
+static void
+output_add(struct output *out, const char *text, size_t len)
+{
+    if (!len || out->failed)
+        return;
+
+    if (out->count == out->capacity) {
+        size_t capacity = out->capacity ? 2 * out->capacity : 1024;
+        struct iovec *iov = realloc(out->iov, capacity * sizeof *iov);
+
+        if (!iov) {
+            out->failed = true;
+            return;
+        }
+        out->iov = iov;
+        out->capacity = capacity;
+    }
+
+    out->iov[out->count].iov_base = (char *) text;
+    out->iov[out->count].iov_len = len;
+    ++out->count;
+}
+
+static void
+output_merged(void *data, const struct textile_span *spans, size_t count)
+{
+    size_t k;
+
+    for (k = 0; k != count; ++k)
+        output_add(data, spans[k].text, spans[k].len);
+}
+
+static void
+output_conflicted(void *data,
+                  const char *base, size_t base_len,
+                  const char *ours, size_t ours_len,
+                  const char *theirs, size_t theirs_len)
+{
+    output_add(data, ours_marker, sizeof ours_marker - 1);
+    output_add(data, ours, ours_len);
+    output_add(data, base_marker, sizeof base_marker - 1);
+    output_add(data, base, base_len);
+    output_add(data, theirs_marker, sizeof theirs_marker - 1);
+    output_add(data, theirs, theirs_len);
+    output_add(data, end_marker, sizeof end_marker - 1);
+}
+
+static bool
+output_write(struct output *out, int fd)
+{
+    struct iovec *iov = out->iov;
+    size_t left = out->count;
+
+    while (left) {
+        int count = left < IOV_MAX ? (int) left : IOV_MAX;
+        ssize_t n = writev(fd, iov, count);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        /* Skip what went out and pick up a partial write where it stopped. */
+        while (left && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --left;
+        }
+        if (n) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * MERGED may well be one of the inputs.  Truncating it while it is mapped
+ * would pull the rug out from under the slices so the result goes to a
+ * temporary file next to it which then takes its place.
+ */
+static bool
+output_save(struct output *out, const char *name)
+{
+    size_t len = strlen(name);
+    char *temp = malloc(len + sizeof ".XXXXXX");
+    bool saved = false;
+    int fd;
+
+    if (!temp)
+        return false;
+    memcpy(temp, name, len);
+    memcpy(temp + len, ".XXXXXX", sizeof ".XXXXXX");
+
+    fd = mkstemp(temp);
+    if (fd >= 0) {
+        struct stat st;
+        mode_t mask;
+
+        if (!stat(name, &st)) {
+            fchmod(fd, st.st_mode & 07777);
+        } else {
+            mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+        saved = output_write(out, fd);
+        saved = !close(fd) && saved;
+        saved = saved && !rename(temp, name);
+        if (!saved)
+            unlink(temp);
+    }
+
+    free(temp);
+    return saved;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct textile_options options = { 0 };
+    struct output out = { 0 };
+    struct input in[3];
+    bool conflicts;
+    int k, status = 2;
+
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: %s BASE OURS THEIRS [MERGED]\n", argv[0]);
+        return 2;
+    }
+
+    for (k = 0; k != 3; ++k) {
+        if (!input_open(&in[k], argv[k + 1])) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[k + 1],
+                    strerror(errno));
+            while (k--)
+                input_close(&in[k]);
+            return 2;
+        }
+    }
+
+    options.flags = TEXTILE_LINES;
+    options.merged_spans = output_merged;
+    conflicts = textile_merge_ex(in[0].text, in[0].len,
+                                 in[1].text, in[1].len,
+                                 in[2].text, in[2].len,
+                                 NULL, output_conflicted, &out, &options);
+
+    if (out.failed)
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(ENOMEM));
+    else if (argc == 5 ? !output_save(&out, argv[4])
+                       : !output_write(&out, STDOUT_FILENO))
+        fprintf(stderr, "%s: %s: %s\n", argv[0],
+                argc == 5 ? argv[4] : "stdout", strerror(errno));
+    else
+        status = conflicts ? 1 : 0;
+
+    free(out.iov);
+    for (k = 0; k != 3; ++k)
+        input_close(&in[k]);
+
+    return status;
 }
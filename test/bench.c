@@ -0,0 +1,233 @@
+/**
+ * © Copyright 2013 Carl N. Baldwin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmarks for the internals of the library.  The library source is
+ * included directly so that the static functions can be timed on their own.
+ *
+ * Usage: bench [size]
+ *
+ * size - Length of the random sequences compared.  The default makes a table
+ *        of about 144MB which is bigger than most last level caches.
+ *
+ * Where the kernel allows it, cache and TLB misses are counted with
+ * perf_event_open(2).
+ */
+
+#include "textile.c"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define COUNTERS 2
+
+struct counters {
+    int fd[COUNTERS];
+    struct timespec start;
+};
+
+static const char *counter_names[COUNTERS] = { "cache-misses", "dTLB-misses" };
+
+static void
+counters_open(struct counters *ctr)
+{
+    int k;
+
+    for (k = 0; k != COUNTERS; ++k)
+        ctr->fd[k] = -1;
+
+#ifdef __linux__
+    {
+        struct perf_event_attr attr;
+        unsigned long long config[COUNTERS] = {
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_CACHE_DTLB
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+        };
+        unsigned types[COUNTERS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+
+        for (k = 0; k != COUNTERS; ++k) {
+            memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = types[k];
+            attr.config = config[k];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            ctr->fd[k] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+#endif
+}
+
+static void
+counters_start(struct counters *ctr)
+{
+#ifdef __linux__
+    int k;
+
+    for (k = 0; k != COUNTERS; ++k) {
+        if (ctr->fd[k] >= 0) {
+            ioctl(ctr->fd[k], PERF_EVENT_IOC_RESET, 0);
+            ioctl(ctr->fd[k], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ctr->start);
+}
+
+static void
+counters_report(struct counters *ctr, const char *what)
+{
+    struct timespec end;
+    unsigned long long value;
+    int k;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("  %-10s %8.3fs", what, (end.tv_sec - ctr->start.tv_sec)
+            + (end.tv_nsec - ctr->start.tv_nsec) / 1e9);
+
+    for (k = 0; k != COUNTERS; ++k) {
+#ifdef __linux__
+        if (ctr->fd[k] >= 0) {
+            ioctl(ctr->fd[k], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(ctr->fd[k], &value, sizeof value) == sizeof value) {
+                printf("  %s %12llu", counter_names[k], value);
+                continue;
+            }
+        }
+#endif
+        (void)value;
+        printf("  %s %12s", counter_names[k], "n/a");
+    }
+    printf("\n");
+}
+
+static void
+counters_close(struct counters *ctr)
+{
+    int k;
+
+    for (k = 0; k != COUNTERS; ++k)
+        if (ctr->fd[k] >= 0)
+            close(ctr->fd[k]);
+}
+
+/*
+ * Fills and traces back the same table in both layouts.  Returns the LCS
+ * length found with the tiled layout after checking that both agree.
+ */
+static size_t
+bench_layouts(struct counters *ctr, const char *x, const char *y, size_t n)
+{
+    static const struct textile_options scalar = {
+        .flags = TEXTILE_NO_SIMD
+    }, simd = {
+        .flags = 0
+    };
+    static const char *names[] = { "row-major", "tiled" };
+    struct textile_match *result[2];
+    struct c_table_16 c;
+    size_t length[2], k;
+    int tiled;
+
+    for (tiled = 0; tiled != 2; ++tiled) {
+        printf("%s\n", names[tiled]);
+
+        result[tiled] = malloc(n * sizeof (struct textile_match));
+        if (!result[tiled] || !c_table_alloc_16(NULL, &c, n, n, tiled)) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        counters_start(ctr);
+        table_fill_16(&scalar, c, x, y);
+        counters_report(ctr, "fill");
+
+        counters_start(ctr);
+        table_fill_16(&simd, c, x, y);
+        counters_report(ctr, "simd fill");
+
+        counters_start(ctr);
+        length[tiled] = table_traceback_16(c, x, y, result[tiled]);
+        counters_report(ctr, "traceback");
+
+        free(c.table);
+    }
+
+    /* Compared field by field since the padding of textile_match is not set. */
+    for (k = 0; k != length[0] && length[0] == length[1]; ++k) {
+        if (result[0][k].i != result[1][k].i
+                || result[0][k].j != result[1][k].j)
+            break;
+    }
+    if (length[0] != length[1] || k != length[0]) {
+        fprintf(stderr, "layouts disagree\n");
+        exit(1);
+    }
+
+    free(result[0]);
+    free(result[1]);
+
+    return length[1];
+}
+
+int
+main(int argc, char **argv)
+{
+    struct counters ctr;
+    size_t k, n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 6000;
+    char *x, *y;
+
+    if (!n || USHRT_MAX < n) {
+        fprintf(stderr, "size must be between 1 and %d\n", USHRT_MAX);
+        return 1;
+    }
+
+    x = malloc(n);
+    y = malloc(n);
+    if (!x || !y) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    /* Similar texts so that the traceback walks near the diagonal. */
+    srand(1);
+    for (k = 0; k != n; ++k) {
+        x[k] = 'a' + rand() % 26;
+        y[k] = (rand() % 8) ? x[k] : 'a' + rand() % 26;
+    }
+
+    printf("%zu x %zu table, %zu MB\n", n, n,
+            n * n * sizeof (struct c_table_entry_16) >> 20);
+
+    counters_open(&ctr);
+    printf("LCS length %zu\n", bench_layouts(&ctr, x, y, n));
+    counters_close(&ctr);
+
+    free(x);
+    free(y);
+
+    return 0;
+}
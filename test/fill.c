@@ -0,0 +1,133 @@
+/**
+ * © Copyright 2013 Carl N. Baldwin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks that the vector fill of the c table gives the same table as the row
+ * by row fill, cell by cell.  The library source is included directly, as in
+ * bench.c, to get at the static functions.
+ *
+ * Every width of entry is tried on tables narrower than a vector, on tables
+ * whose sides are not multiples of a tile and on tiled tables.  Exits with 77,
+ * which make check reports as skipped, if there is no vector fill.
+ */
+
+#include "textile.c"
+
+#include <stdio.h>
+
+/* Sides of the tables tried.  Every pair of these is filled. */
+static const size_t sides[] = { 1, 2, 7, 31, 33, 63, 65, 200, 300 };
+
+/*
+ * Defines fill_check_NAME() which fills an m by n table of entries
+ * c_table_NAME both ways and reports the first cell that differs.  Returns
+ * false on a difference.
+ */
+#define FILL_CHECK(NAME, SYMBOL) \
+static bool \
+fill_check_##NAME(const SYMBOL *x, size_t m, const SYMBOL *y, size_t n) \
+{ \
+    struct c_table_##NAME rows, diagonals; \
+    struct c_table_entry_##NAME a, b; \
+    size_t i, j; \
+    bool tiled = m * n > C_TABLE_TILED_CELLS, same = true; \
+\
+    if (!c_table_alloc_##NAME(NULL, &rows, m, n, tiled) \
+            || !c_table_alloc_##NAME(NULL, &diagonals, m, n, tiled)) { \
+        fprintf(stderr, "out of memory\n"); \
+        exit(1); \
+    } \
+\
+    table_fill_rows_##NAME(rows, x, y); \
+    if (!table_fill_diagonals_##NAME(NULL, diagonals, x, y)) { \
+        fprintf(stderr, "out of memory\n"); \
+        exit(1); \
+    } \
+\
+    for (i = 0; i != m && same; ++i) { \
+        for (j = 0; j != n && same; ++j) { \
+            a = c_get_##NAME(rows, i, j); \
+            b = c_get_##NAME(diagonals, i, j); \
+            if (a.c != b.c || a.g != b.g) { \
+                fprintf(stderr, "%s %zu x %zu: cell (%zu, %zu) is" \
+                        " c=%u g=%u by rows but c=%u g=%u by diagonals\n", \
+                        #NAME, m, n, i, j, (unsigned)a.c, (unsigned)a.g, \
+                        (unsigned)b.c, (unsigned)b.g); \
+                same = false; \
+            } \
+        } \
+    } \
+\
+    free(rows.table); \
+    free(diagonals.table); \
+\
+    return same; \
+}
+
+FILL_CHECK(8, char)
+FILL_CHECK(16, char)
+FILL_CHECK(32, char)
+FILL_CHECK(16_u16, uint16_t)
+FILL_CHECK(16_u32, uint32_t)
+
+#undef FILL_CHECK
+
+int
+main(void)
+{
+    enum { MAX_SIDE = 300 };
+    char x[MAX_SIDE], y[MAX_SIDE];
+    uint16_t x16[MAX_SIDE], y16[MAX_SIDE];
+    uint32_t x32[MAX_SIDE], y32[MAX_SIDE];
+    size_t a, b, k, m, n, count = sizeof sides / sizeof *sides;
+    bool same = true;
+
+#ifndef HAVE_VECTORS
+    printf("no vector fill to check\n");
+    return 77;
+#endif
+
+    /*
+     * Close texts over a few symbols so that matches group and tie.  Zero is
+     * one of them since it is also what pads the vectors past either end.
+     */
+    srand(1);
+    for (k = 0; k != MAX_SIDE; ++k) {
+        x[k] = rand() % 4;
+        y[k] = (rand() % 4) ? x[k] : rand() % 4;
+        x16[k] = x[k] ? 0x3b0 + x[k] : 0;
+        y16[k] = y[k] ? 0x3b0 + y[k] : 0;
+        x32[k] = x[k] ? 1000000 + x[k] : 0;
+        y32[k] = y[k] ? 1000000 + y[k] : 0;
+    }
+
+    for (a = 0; a != count; ++a) {
+        for (b = 0; b != count; ++b) {
+            m = sides[a];
+            n = sides[b];
+
+            /* Values past 255 don't fit the narrowest entries. */
+            if (m < 256 || n < 256)
+                same = fill_check_8(x, m, y, n) && same;
+            same = fill_check_16(x, m, y, n) && same;
+            same = fill_check_32(x, m, y, n) && same;
+            same = fill_check_16_u16(x16, m, y16, n) && same;
+            same = fill_check_16_u32(x32, m, y32, n) && same;
+        }
+    }
+
+    return same ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Runs the textile program on a few merges and checks what it writes and
+# its exit status.  TEXTILE names the program to run.
+
+TEXTILE=${TEXTILE:-../src/textile}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+failed=0
+
+fail() {
+    echo "FAIL: $*" >&2
+    failed=1
+}
+
+# expect NAME STATUS EXPECTED_OUTPUT_FILE ARGS...
+expect() {
+    local name=$1 status=$2 expected=$3
+    shift 3
+
+    "$TEXTILE" "$@" > "$dir/out" 2> "$dir/err"
+    local rc=$?
+
+    [ $rc = $status ] || fail "$name: exit status $rc, wanted $status"
+    if [ "$expected" ]; then
+        cmp -s "$expected" "$dir/out" || fail "$name: wrong output"
+    fi
+}
+
+# Clean merge: each side changes a different line.
+printf 'one\ntwo\nthree\n' > "$dir/base"
+printf 'ONE\ntwo\nthree\n' > "$dir/ours"
+printf 'one\ntwo\nTHREE\n' > "$dir/theirs"
+printf 'ONE\ntwo\nTHREE\n' > "$dir/clean"
+expect clean 0 "$dir/clean" "$dir/base" "$dir/ours" "$dir/theirs"
+
+# Conflicted merge: both sides change the same word.
+printf 'one two three\n' > "$dir/base"
+printf 'one 2 three\n' > "$dir/ours"
+printf 'one II three\n' > "$dir/theirs"
+printf 'one <<<<<<<2|||||||two=======II>>>>>>> three\n' > "$dir/conflicted"
+expect conflicted 1 "$dir/conflicted" "$dir/base" "$dir/ours" "$dir/theirs"
+
+# The result can go to a file, even one of the inputs.
+cp "$dir/ours" "$dir/merged"
+expect in-place 1 /dev/null "$dir/base" "$dir/merged" "$dir/theirs" "$dir/merged"
+cmp -s "$dir/conflicted" "$dir/merged" || fail "in-place: wrong output"
+
+# Missing input.
+expect missing 2 /dev/null "$dir/base" "$dir/nope" "$dir/theirs"
+grep -q nope "$dir/err" || fail "missing: no error message"
+
+# Enough conflicts for more than IOV_MAX pieces of output.
+: > "$dir/base"; : > "$dir/ours"; : > "$dir/theirs"; : > "$dir/many"
+for ((k = 0; k != 2000; ++k)); do
+    echo "line $k a" >> "$dir/base"
+    echo "line $k b" >> "$dir/ours"
+    echo "line $k c" >> "$dir/theirs"
+    echo "line $k <<<<<<<b|||||||a=======c>>>>>>>" >> "$dir/many"
+done
+expect many 1 "$dir/many" "$dir/base" "$dir/ours" "$dir/theirs"
+
+exit $failed
@@ -1,11 +1,18 @@
 #include "gtest/gtest.h"
 
 #include "textile.h"
+#include "textile.hpp"
 
 #include <string>
+#include <vector>
 #include <sstream>
 #include <iterator>
 #include <fstream>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+
+#include <pthread.h>
 
 using std::string;
 using std::ostream_iterator;
@@ -13,6 +20,7 @@ using std::istreambuf_iterator;
 using std::ostringstream;
 using std::copy;
 using std::ifstream;
+using std::to_string;
 
 namespace {
 
@@ -22,10 +30,90 @@ namespace {
                 istreambuf_iterator<char>());
     }
 
+    /* Deterministic filler text made of lower case words. */
+    string lorem(size_t len, unsigned seed) {
+        static const char *words[] = {
+            "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+            "adipiscing", "elit", "nam", "nec", "massa", "tincidunt"
+        };
+        string text;
+
+        while (text.length() < len) {
+            seed = seed * 1103515245 + 12345;
+            text += words[(seed >> 16) % (sizeof words / sizeof *words)];
+            text += ((seed >> 8) % 11) ? " " : ".\n";
+        }
+        text.resize(len);
+        return text;
+    }
+
+    /* Executor for TEXTILE_CONCURRENT that runs each task on a new thread. */
+    struct ExecutorTask {
+        void (*task)(void *);
+        void *arg;
+    };
+
+    void *executor_thread(void *data) {
+        ExecutorTask *t = reinterpret_cast<ExecutorTask*>(data);
+        t->task(t->arg);
+        delete t;
+        return NULL;
+    }
+
+    int executor_submit(void *data, void (*task)(void *), void *arg) {
+        int *submitted = reinterpret_cast<int*>(data);
+        ExecutorTask *t = new ExecutorTask;
+        pthread_t thread;
+
+        t->task = task;
+        t->arg = arg;
+        if (pthread_create(&thread, NULL, executor_thread, t)) {
+            delete t;
+            return -1;
+        }
+        pthread_detach(thread);
+        ++*submitted;
+        return 0;
+    }
+
+    int executor_refuse(void *data, void (*task)(void *), void *arg) {
+        return -1;
+    }
+
+    /* Allocator for textile_ctx_new_allocator() that counts what is out. */
+    struct CountingAllocator {
+        pthread_mutex_t lock;
+        size_t allocs;
+        size_t outstanding;
+    };
+
+    void *counting_alloc(void *data, size_t size) {
+        CountingAllocator *a = reinterpret_cast<CountingAllocator*>(data);
+        void *p = malloc(size);
+
+        pthread_mutex_lock(&a->lock);
+        a->allocs++;
+        a->outstanding += p != NULL;
+        pthread_mutex_unlock(&a->lock);
+        return p;
+    }
+
+    void counting_free(void *data, void *p) {
+        CountingAllocator *a = reinterpret_cast<CountingAllocator*>(data);
+
+        pthread_mutex_lock(&a->lock);
+        a->outstanding--;
+        pthread_mutex_unlock(&a->lock);
+        free(p);
+    }
+
     struct TextileHelper {
         ostringstream stream;
+        size_t merged_calls;
 
-        void merged(string str) { stream << str; }
+        TextileHelper() : merged_calls(0) {}
+
+        void merged(string str) { stream << str; ++merged_calls; }
 
         void conflicted( string base, string ours, string theirs) {
             stream << "<<<<<<<" << ours << "|||||||" << base
@@ -38,6 +126,15 @@ namespace {
             instance->merged(string(str, size));
         }
 
+        static void spans_callback(void *data,
+                const struct textile_span *spans, size_t count) {
+            TextileHelper *instance = reinterpret_cast<TextileHelper*>(data);
+
+            for (size_t k = 0; k != count; ++k)
+                instance->stream << string(spans[k].text, spans[k].len);
+            ++instance->merged_calls;
+        }
+
         static void conflict_callback(void *data,
                 const char *base, size_t base_size,
                 const char *ours, size_t ours_size,
@@ -62,6 +159,20 @@ namespace {
                     reinterpret_cast<void*>(this));
         }
 
+        bool call_textile_merge( string base, string ours, string theirs,
+                const struct textile_options &options) {
+            return textile_merge_ex(
+                    base.c_str(), base.length(),
+                    ours.c_str(), ours.length(),
+                    theirs.c_str(), theirs.length(),
+
+                    TextileHelper::merged_callback,
+                    TextileHelper::conflict_callback,
+
+                    reinterpret_cast<void*>(this),
+                    &options);
+        }
+
         bool call_textile_merge( ifstream &base, ifstream &ours, ifstream &theirs) {
             return call_textile_merge(
                     ifstream_to_string(base),
@@ -208,6 +319,873 @@ namespace {
         ifstream golden("data/OnlyDeletes/golden");
         ASSERT_EQ(ifstream_to_string(golden), merge.stream.str());
     }
+
+    TEST_F(TextileTest, TestLargeMerge) {
+        /*
+         * What is left between the changes after trimming is too big for one
+         * LCS table within this budget so it is solved in smaller pieces.
+         */
+        string head = lorem(1500, 1), middle = lorem(1500, 2), tail = lorem(1500, 3);
+        struct textile_options options = textile_options();
+        options.max_memory = 64 * 1024;
+
+        bool rc = merge.call_textile_merge(
+            head + "first" + middle + "second" + tail,
+            head + "FIRST" + middle + "second" + tail,
+            head + "first" + middle + "SECOND" + tail,
+            options
+            );
+
+        ASSERT_FALSE(rc);
+        ASSERT_EQ(head + "FIRST" + middle + "SECOND" + tail, merge.stream.str());
+    }
+
+    TEST_F(TextileTest, TestWholeFile) {
+        /*
+         * Far apart changes leave a middle that is too different for a band
+         * of the table.  It is cut up at unique lines instead.
+         */
+        string a = lorem(10000, 8), b = lorem(10000, 9), c = lorem(10000, 10);
+        string rewritten = lorem(10000, 11);
+
+        bool rc = merge.call_textile_merge(
+            "top\n" + a + "\nremoved\n" + b + "\n" + c + "bottom\n",
+            "TOP\n" + a + "\n" + rewritten + "\n" + c + "bottom\n",
+            "top\n" + a + "\nremoved\n" + b + "\n" + c + "BOTTOM\n"
+            );
+
+        ASSERT_FALSE(rc);
+        ASSERT_EQ("TOP\n" + a + "\n" + rewritten + "\n" + c + "BOTTOM\n",
+                merge.stream.str());
+    }
+
+    TEST_F(TextileTest, TestAnchorSmall) {
+        /*
+         * Small enough for the table but anchored on unique lines first.
+         * Matched byte by byte, the two deletes would leave "int " behind.
+         */
+        bool rc = merge.call_textile_merge(
+            "x++;\nint b = 2;\nfoo();\nint a = 1;\nint b = 2;\n",
+            "x++;\nint b = 2;\nfoo();\nint a = 1;\n",
+            "x++;\nint b = 2;\nfoo();\nint b = 2;\n"
+            );
+
+        ASSERT_FALSE(rc);
+        ASSERT_EQ("x++;\nint b = 2;\nfoo();\n", merge.stream.str());
+    }
+
+    TEST_F(TextileTest, TestEngines) {
+        enum textile_engine engines[] = {
+            TEXTILE_ENGINE_TABLE, TEXTILE_ENGINE_LINEAR, TEXTILE_ENGINE_MYERS,
+            TEXTILE_ENGINE_BITS, TEXTILE_ENGINE_BANDED
+        };
+        string head = lorem(1500, 1), middle = lorem(1500, 2), tail = lorem(1500, 3);
+
+        for (size_t i = 0; i != sizeof engines / sizeof *engines; ++i) {
+            struct textile_options options = textile_options();
+            options.engine = engines[i];
+
+            TextileHelper small;
+            ASSERT_FALSE(small.call_textile_merge(
+                    "A shrt strang.", "A short strang.", "A shrt string.",
+                    options));
+            ASSERT_EQ("A short string.", small.stream.str());
+
+            /*
+             * Too big for one table within the budget.  The engines that
+             * split the problem have to go below the table to solve it.
+             */
+            unsigned used = 0;
+            options.max_memory = 64 * 1024;
+            options.engines_used = &used;
+            TextileHelper large;
+            ASSERT_FALSE(large.call_textile_merge(
+                    head + "first" + middle + "second" + tail,
+                    head + "FIRST" + middle + "second" + tail,
+                    head + "first" + middle + "SECOND" + tail,
+                    options));
+            ASSERT_EQ(head + "FIRST" + middle + "SECOND" + tail,
+                    large.stream.str());
+            ASSERT_NE(0u, used & 1u << engines[i]);
+
+            /*
+             * Ours changes both ends so that what is left of it against base
+             * can't be trimmed down to a piece that fits a table.  Myers'
+             * algorithm has to split it at middle snakes first.
+             */
+            string changed = middle;
+            changed.replace(700, 5, "their");
+            TextileHelper spread;
+            ASSERT_FALSE(spread.call_textile_merge(
+                    head + "first" + middle + "second" + tail,
+                    head + "FIRST" + middle + "SECOND" + tail,
+                    head + "first" + changed + "second" + tail,
+                    options));
+            ASSERT_EQ(head + "FIRST" + changed + "SECOND" + tail,
+                    spread.stream.str());
+        }
+    }
+
+    TEST_F(TextileTest, TestTableLongInput) {
+        struct textile_options options = textile_options();
+        options.engine = TEXTILE_ENGINE_TABLE;
+        string text = lorem(70000, 4);
+
+        ASSERT_FALSE(merge.call_textile_merge(
+                "Short.", text + "Short.", "Short!", options));
+        ASSERT_EQ(text + "Short!", merge.stream.str());
+    }
+
+    TEST_F(TextileTest, TestSameSides) {
+        string text = lorem(5000, 5);
+
+        TextileHelper unchanged_ours;
+        ASSERT_FALSE(unchanged_ours.call_textile_merge(text, text, "theirs"));
+        ASSERT_EQ("theirs", unchanged_ours.stream.str());
+
+        TextileHelper unchanged_theirs;
+        ASSERT_FALSE(unchanged_theirs.call_textile_merge(text, "ours", text));
+        ASSERT_EQ("ours", unchanged_theirs.stream.str());
+
+        TextileHelper both;
+        ASSERT_FALSE(both.call_textile_merge("base", text, text));
+        ASSERT_EQ(text, both.stream.str());
+    }
+
+    TEST_F(TextileTest, TestCommonEnds) {
+        string head = lorem(3000, 6), tail = lorem(3000, 7);
+        bool rc = merge.call_textile_merge(
+                head + "one two three" + tail,
+                head + "one 2 three" + tail,
+                head + "one II three" + tail);
+
+        ASSERT_TRUE(rc);
+        ASSERT_EQ(head + "one <<<<<<<2|||||||two=======II>>>>>>> three" + tail,
+                merge.stream.str());
+    }
+
+    TEST_F(TextileTest, TestCommonEndsTies) {
+        /*
+         * Changes next to repeated symbols merge the same with the shared
+         * ends around them as they do on their own.
+         */
+        string head = lorem(3000, 6), tail = lorem(3000, 7);
+
+        TextileHelper clean;
+        ASSERT_FALSE(clean.call_textile_merge(
+                head + "\n cacc" + tail,
+                head + "\n cc " + tail,
+                head + "\n cac " + tail));
+        ASSERT_EQ(head + "\n cc " + tail, clean.stream.str());
+
+        TextileHelper conflicted;
+        ASSERT_TRUE(conflicted.call_textile_merge(
+                head + " c\n\nd\n a d c c\n" + tail,
+                head + " c\n\n\n\nd\n a d c c\n" + tail,
+                head + " c\n\n\n a  c\n" + tail));
+        ASSERT_EQ(head + " c\n\n<<<<<<<\n\nd|||||||d=======>>>>>>>\n a  c\n"
+                + tail, conflicted.stream.str());
+    }
+
+    TEST_F(TextileTest, TestNoSimd) {
+        ifstream base("data/AllMergeTypes/base");
+        ifstream ours("data/AllMergeTypes/ours");
+        ifstream theirs("data/AllMergeTypes/theirs");
+        struct textile_options options = textile_options();
+        options.flags = TEXTILE_NO_SIMD;
+
+        bool rc = merge.call_textile_merge(
+                ifstream_to_string(base),
+                ifstream_to_string(ours),
+                ifstream_to_string(theirs),
+                options);
+
+        ASSERT_TRUE(rc);
+
+        ifstream golden("data/AllMergeTypes/golden");
+        ASSERT_EQ(ifstream_to_string(golden), merge.stream.str());
+    }
+
+    TEST_F(TextileTest, TestThreads) {
+        /*
+         * The changes are far enough apart that what is left between them
+         * after trimming is big enough for the table to be split between
+         * threads.
+         */
+        string base = lorem(1400, 4), ours = base, theirs = base;
+        struct textile_options options = textile_options();
+        unsigned threads = 0;
+        options.engine = TEXTILE_ENGINE_TABLE;
+        options.threads_used = &threads;
+
+        ours.replace(100, 10, "our change");
+        ours.replace(700, 3, "");
+        theirs.replace(105, 20, "their change");
+        theirs.replace(1300, 0, "their addition");
+
+        TextileHelper serial;
+        bool rc = serial.call_textile_merge(base, ours, theirs, options);
+        ASSERT_EQ(0u, threads);
+
+        options.threads = 4;
+        ASSERT_EQ(rc, merge.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(serial.stream.str(), merge.stream.str());
+        ASSERT_LT(1u, threads);
+    }
+
+    TEST_F(TextileTest, TestConcurrent) {
+        string base = lorem(1200, 4), ours = base, theirs = base;
+        struct textile_options options = textile_options();
+
+        ours.replace(100, 10, "our change");
+        theirs.replace(105, 20, "their change");
+        theirs.replace(1000, 0, "their addition");
+
+        TextileHelper serial;
+        bool rc = serial.call_textile_merge(base, ours, theirs, options);
+
+        options.flags = TEXTILE_CONCURRENT;
+        ASSERT_EQ(rc, merge.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(serial.stream.str(), merge.stream.str());
+
+        int submitted = 0;
+        options.submit = executor_submit;
+        options.executor_data = &submitted;
+        TextileHelper executor;
+        ASSERT_EQ(rc, executor.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(serial.stream.str(), executor.stream.str());
+        ASSERT_EQ(1, submitted);
+
+        options.submit = executor_refuse;
+        TextileHelper refused;
+        ASSERT_EQ(rc, refused.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(serial.stream.str(), refused.stream.str());
+    }
+
+    TEST_F(TextileTest, TestIndex) {
+        string base = lorem(12000, 12);
+        struct textile_index *index = textile_index_build(
+                base.c_str(), base.length());
+        ASSERT_TRUE(index != NULL);
+
+        for (unsigned seed = 0; seed != 4; ++seed) {
+            struct textile_options options = textile_options();
+            string ours = lorem(1000, 20 + seed) + base.substr(0, 11000);
+            string theirs = base.substr(500) + lorem(1000, 30 + seed);
+
+            if (seed % 2)
+                options.engine = TEXTILE_ENGINE_BITS;
+
+            TextileHelper plain;
+            bool rc = plain.call_textile_merge(base, ours, theirs, options);
+
+            /* The index only applies to the buffer it was built over. */
+            options.index = index;
+            TextileHelper indexed;
+            ASSERT_EQ(rc, textile_merge_ex(
+                    base.c_str(), base.length(),
+                    ours.c_str(), ours.length(),
+                    theirs.c_str(), theirs.length(),
+                    TextileHelper::merged_callback,
+                    TextileHelper::conflict_callback,
+                    &indexed, &options));
+            ASSERT_EQ(plain.stream.str(), indexed.stream.str());
+        }
+
+        textile_index_free(index);
+    }
+
+    TEST_F(TextileTest, TestTokens) {
+        struct textile_options options = textile_options();
+        options.flags = TEXTILE_TOKENS;
+
+        TextileHelper renames;
+        ASSERT_FALSE(renames.call_textile_merge(
+                "total = count + offset;\n",
+                "total = items + offset;\n",
+                "total = count + shift;\n",
+                options));
+        ASSERT_EQ("total = items + shift;\n", renames.stream.str());
+
+        /* Conflicts are whole tokens, not the letters the words share. */
+        TextileHelper conflict;
+        ASSERT_TRUE(conflict.call_textile_merge(
+                "call(alpha, 0x1F);", "call(beta, 0x1F);", "call(alpine, 0x1F);",
+                options));
+        ASSERT_EQ("call(<<<<<<<beta|||||||alpha=======alpine>>>>>>>, 0x1F);",
+                conflict.stream.str());
+
+        /* Big enough that the tokens are anchored on lines. */
+        string a = lorem(10000, 8), b = lorem(10000, 9), c = lorem(10000, 10);
+        string rewritten = lorem(10000, 11);
+
+        TextileHelper large;
+        ASSERT_FALSE(large.call_textile_merge(
+            "top\n" + a + "\nremoved\n" + b + "\n" + c + "bottom\n",
+            "TOP\n" + a + "\n" + rewritten + "\n" + c + "bottom\n",
+            "top\n" + a + "\nremoved\n" + b + "\n" + c + "BOTTOM\n",
+            options));
+        ASSERT_EQ("TOP\n" + a + "\n" + rewritten + "\n" + c + "BOTTOM\n",
+                large.stream.str());
+    }
+
+    TEST_F(TextileTest, TestLines) {
+        struct textile_options options = textile_options();
+        options.flags = TEXTILE_LINES;
+
+        /* Lines changed on both sides are still merged byte by byte. */
+        TextileHelper simple;
+        ASSERT_FALSE(simple.call_textile_merge(
+            "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n"
+            "Nam nec massa tincidunt, consectetur nunc in, commodo dui.\n",
+
+            "Lorem ipsum color sit amen, consectetur adipiscing elit.\n"
+            "Name nec massa tincidunt, consectetur nunc in, commode dui.\n",
+
+            "Lorem ipsum dolor set amet, consectur adipiscing elite.\n"
+            "Nam nec mass tincidunt, consectetur nunc in, commodo dui.\n",
+            options));
+        ASSERT_EQ(
+            "Lorem ipsum color set amen, consectur adipiscing elite.\n"
+            "Name nec mass tincidunt, consectetur nunc in, commode dui.\n",
+            simple.stream.str());
+
+        ifstream base("data/AllMergeTypes/base");
+        ifstream ours("data/AllMergeTypes/ours");
+        ifstream theirs("data/AllMergeTypes/theirs");
+        TextileHelper all;
+        ASSERT_TRUE(all.call_textile_merge(
+                ifstream_to_string(base),
+                ifstream_to_string(ours),
+                ifstream_to_string(theirs),
+                options));
+        ifstream golden("data/AllMergeTypes/golden");
+        ASSERT_EQ(ifstream_to_string(golden), all.stream.str());
+
+        /* Far too big for bytes, with a conflict in the middle. */
+        string a = lorem(100000, 8), b = lorem(100000, 9);
+        TextileHelper large;
+        ASSERT_TRUE(large.call_textile_merge(
+            "top\n" + a + "\nremoved\nint x = 1;\n" + b + "\nbottom\n",
+            "TOP\n" + a + "\nint x = 2;\n" + b + "\nbottom\n",
+            "top\n" + a + "\nremoved\nint x = 3;\n" + b + "\nBOTTOM\n",
+            options));
+        ASSERT_EQ("TOP\n" + a + "\nint x = <<<<<<<2|||||||1=======3>>>>>>>;\n"
+                + b + "\nBOTTOM\n", large.stream.str());
+    }
+
+    TEST_F(TextileTest, TestCascade) {
+        struct textile_options options = textile_options();
+        options.flags = TEXTILE_TOKENS | TEXTILE_CASCADE;
+
+        /* The tokens conflict but the bytes within them do not. */
+        TextileHelper tokens;
+        ASSERT_FALSE(tokens.call_textile_merge(
+                "colour = 1;\n", "color = 1;\n", "colours = 1;\n", options));
+        ASSERT_EQ("colors = 1;\n", tokens.stream.str());
+
+        string a = lorem(100000, 8), b = lorem(100000, 9);
+        string base = "top\n" + a + "\nint colour = 1;\n" + b + "\nbottom\n";
+        string ours = "TOP\n" + a + "\nint color = 1;\n" + b + "\nbottom\n";
+        string theirs = "top\n" + a + "\nint colours = 2;\n" + b + "\nBOTTOM\n";
+
+        options.flags |= TEXTILE_LINES;
+        TextileHelper lines;
+        ASSERT_FALSE(lines.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ("TOP\n" + a + "\nint colors = 2;\n" + b + "\nBOTTOM\n",
+                lines.stream.str());
+
+        /* Conflicts over the limit stop at the level that found them. */
+        options.byte_limit = 8;
+        TextileHelper limited;
+        ASSERT_TRUE(limited.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ("TOP\n" + a + "\nint <<<<<<<color|||||||colour"
+                "=======colours>>>>>>> = 2;\n" + b + "\nBOTTOM\n",
+                limited.stream.str());
+
+        options.token_limit = 8;
+        TextileHelper line_limited;
+        ASSERT_TRUE(line_limited.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ("TOP\n" + a + "\n<<<<<<<int color = 1;\n|||||||"
+                "int colour = 1;\n=======int colours = 2;\n>>>>>>>"
+                + b + "\nBOTTOM\n", line_limited.stream.str());
+    }
+
+    TEST_F(TextileTest, TestMemoryBudget) {
+        string head = lorem(1500, 1), middle = lorem(1500, 2), tail = lorem(1500, 3);
+        string base = head + "first" + middle + "second" + tail;
+        string ours = head + "FIRST" + middle + "second" + tail;
+        string theirs = head + "first" + middle + "SECOND" + tail;
+        struct textile_options options = textile_options();
+        unsigned engines = 0;
+        options.engines_used = &engines;
+
+        ASSERT_FALSE(merge.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(head + "FIRST" + middle + "SECOND" + tail, merge.stream.str());
+        ASSERT_EQ(1u << TEXTILE_ENGINE_TABLE, engines);
+
+        /*
+         * Too little for a table or band over the middle.  Small gaps still
+         * get a table of their own.
+         */
+        engines = 0;
+        options.max_memory = 1024;
+        TextileHelper small;
+        ASSERT_FALSE(small.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(head + "FIRST" + middle + "SECOND" + tail, small.stream.str());
+        ASSERT_EQ(0u, engines & 1u << TEXTILE_ENGINE_BANDED);
+        ASSERT_NE(0u, engines & ~(1u << TEXTILE_ENGINE_TABLE));
+    }
+
+    void *limited_alloc(void *data, size_t size) {
+        return size > *reinterpret_cast<size_t*>(data) ? NULL : malloc(size);
+    }
+
+    void limited_free(void *, void *p) {
+        free(p);
+    }
+
+    TEST_F(TextileTest, TestTableAllocationFails) {
+        string head = lorem(1000, 1), middle = lorem(1000, 2), tail = lorem(1000, 3);
+        string base = head + "first" + middle + "second" + tail;
+        string ours = head + "FIRST" + middle + "second" + tail;
+        string theirs = head + "first" + middle + "SECOND" + tail;
+        string golden = head + "FIRST" + middle + "SECOND" + tail;
+
+        /*
+         * The table over the middle fits the budget but the allocator turns
+         * it down.  The engines that hand pieces to the table split them
+         * further instead of giving up on them.
+         */
+        size_t limit = 200 * 1024;
+        struct textile_allocator allocator = {
+            limited_alloc, limited_free, &limit
+        };
+        struct textile_ctx *ctx = textile_ctx_new_allocator(0, &allocator);
+        ASSERT_TRUE(ctx != NULL);
+
+        const enum textile_engine engines[] = {
+            TEXTILE_ENGINE_AUTO, TEXTILE_ENGINE_LINEAR, TEXTILE_ENGINE_MYERS
+        };
+        for (size_t k = 0; k != sizeof engines / sizeof *engines; ++k) {
+            struct textile_options options = textile_options();
+            options.engine = engines[k];
+            options.ctx = ctx;
+            TextileHelper limited;
+            ASSERT_FALSE(limited.call_textile_merge(base, ours, theirs,
+                                                    options));
+            ASSERT_EQ(golden, limited.stream.str());
+        }
+
+        textile_ctx_free(ctx);
+    }
+
+    TEST_F(TextileTest, TestContext) {
+        string head = lorem(1500, 1), middle = lorem(1500, 2), tail = lorem(1500, 3);
+        struct textile_ctx *ctx = textile_ctx_new(TEXTILE_CTX_HUGE_PAGES);
+        ASSERT_TRUE(ctx != NULL);
+
+        unsigned flags[] = {
+            0, TEXTILE_CONCURRENT, TEXTILE_LINES | TEXTILE_TOKENS,
+            TEXTILE_LINES | TEXTILE_TOKENS | TEXTILE_CASCADE
+        };
+
+        for (size_t i = 0; i != sizeof flags / sizeof *flags; ++i) {
+            struct textile_options options = textile_options();
+            options.flags = flags[i];
+
+            TextileHelper plain;
+            bool rc = plain.call_textile_merge(
+                    "A shrt strang.\n" + middle + "one two three\n",
+                    "A short strang.\n" + middle + "one 2 three\n",
+                    "A shrt string.\n" + middle + "one II three\n",
+                    options);
+
+            /* Reused from one merge to the next and within each one. */
+            options.ctx = ctx;
+            for (int k = 0; k != 2; ++k) {
+                TextileHelper reused;
+                ASSERT_EQ(rc, reused.call_textile_merge(
+                        "A shrt strang.\n" + middle + "one two three\n",
+                        "A short strang.\n" + middle + "one 2 three\n",
+                        "A shrt string.\n" + middle + "one II three\n",
+                        options));
+                ASSERT_EQ(plain.stream.str(), reused.stream.str());
+            }
+
+            TextileHelper large;
+            ASSERT_FALSE(large.call_textile_merge(
+                    head + "first" + middle + "second" + tail,
+                    head + "FIRST" + middle + "second" + tail,
+                    head + "first" + middle + "SECOND" + tail,
+                    options));
+            ASSERT_EQ(head + "FIRST" + middle + "SECOND" + tail,
+                    large.stream.str());
+        }
+
+        textile_ctx_free(ctx);
+    }
+
+    TEST_F(TextileTest, TestAllocator) {
+        string a = lorem(20000, 8), b = lorem(20000, 9);
+        string base = "top\n" + a + "\nint colour = 1;\n" + b + "\nbottom\n";
+        string ours = "TOP\n" + a + "\nint color = 1;\n" + b + "\nbottom\n";
+        string theirs = lorem(500, 10) + a + "\nint colours = 2;\n" + b;
+        CountingAllocator counter = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+        struct textile_allocator allocator = {
+            counting_alloc, counting_free, &counter
+        };
+        unsigned flags[] = {
+            0, TEXTILE_CONCURRENT, TEXTILE_LINES | TEXTILE_TOKENS | TEXTILE_CASCADE
+        };
+
+        struct textile_ctx *ctx = textile_ctx_new_allocator(0, &allocator);
+        ASSERT_TRUE(ctx != NULL);
+
+        for (size_t i = 0; i != sizeof flags / sizeof *flags; ++i) {
+            struct textile_options options = textile_options();
+            options.flags = flags[i];
+            options.threads = 4;
+
+            TextileHelper plain;
+            bool rc = plain.call_textile_merge(base, ours, theirs, options);
+
+            options.ctx = ctx;
+            TextileHelper counted;
+            ASSERT_EQ(rc, counted.call_textile_merge(base, ours, theirs, options));
+            ASSERT_EQ(plain.stream.str(), counted.stream.str());
+        }
+
+        textile_ctx_trim(ctx);
+        ASSERT_LT(1u, counter.allocs);
+        ASSERT_EQ(1u, counter.outstanding);
+
+        textile_ctx_free(ctx);
+        ASSERT_EQ(0u, counter.outstanding);
+    }
+
+    TEST_F(TextileTest, TestMergedSpans) {
+        string head = lorem(1500, 1), middle = lorem(1500, 2), tail = lorem(1500, 3);
+        string base = head + "first" + middle + "one two three" + tail;
+        string ours = head + "FIRST" + middle + "one 2 three" + tail;
+        string theirs = head + "first" + middle + "one II three" + tail;
+        string golden = head + "FIRST" + middle
+            + "one <<<<<<<2|||||||two=======II>>>>>>> three" + tail;
+
+        /* A run of matches comes out as one span, not one per byte. */
+        ASSERT_TRUE(merge.call_textile_merge(base, ours, theirs));
+        ASSERT_EQ(golden, merge.stream.str());
+        ASSERT_GE(5u, merge.merged_calls);
+
+        struct textile_options options = textile_options();
+        options.merged_spans = TextileHelper::spans_callback;
+        TextileHelper spans;
+        ASSERT_TRUE(spans.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(golden, spans.stream.str());
+        ASSERT_EQ(2u, spans.merged_calls);
+
+        options.flags = TEXTILE_LINES | TEXTILE_TOKENS | TEXTILE_CASCADE;
+        TextileHelper cascade;
+        ASSERT_TRUE(cascade.call_textile_merge(base, ours, theirs, options));
+        ASSERT_EQ(golden, cascade.stream.str());
+    }
+
+    static void collect_spans(void *data, const struct textile_span *spans,
+                              size_t count) {
+        std::vector<string> *collected =
+            reinterpret_cast<std::vector<string> *>(data);
+
+        for (size_t k = 0; k != count; ++k)
+            collected->push_back(string(spans[k].text, spans[k].len));
+    }
+
+    static void ignore_conflict(void *, const char *, size_t, const char *,
+                                size_t, const char *, size_t) {
+    }
+
+    TEST_F(TextileTest, TestMergedSpansSharedMemory) {
+        /*
+         * ours is "Xab" and theirs is "abY", right after it in memory.  The
+         * "Xab" from ours and the "Y" from theirs are neighbours but must not
+         * be joined into a span that is in neither input.
+         */
+        string mem = "XabY";
+        struct textile_options options = textile_options();
+        options.merged_spans = collect_spans;
+        std::vector<string> spans;
+
+        ASSERT_FALSE(textile_merge_ex(mem.data() + 1, 2, mem.data(), 3,
+                                      mem.data() + 1, 3, NULL,
+                                      ignore_conflict, &spans, &options));
+        ASSERT_EQ(2u, spans.size());
+        ASSERT_EQ("Xab", spans[0]);
+        ASSERT_EQ("Y", spans[1]);
+    }
+
+    TEST_F(TextileTest, TestMergeToBuffer) {
+        string base = "one two three four", ours = "one 2 three FOUR",
+               theirs = "one II three four";
+        string golden = "one <<<<<<<2|||||||two=======II>>>>>>> three FOUR";
+
+        size_t bound = textile_merge_bound(base.length(), ours.length(),
+                                           theirs.length(), NULL);
+        string buffer(bound, '\0');
+        size_t length = 0;
+        ASSERT_TRUE(textile_merge_to_buffer(
+                base.c_str(), base.length(),
+                ours.c_str(), ours.length(),
+                theirs.c_str(), theirs.length(),
+                &buffer[0], buffer.size(), &length, NULL, NULL));
+        ASSERT_EQ(golden, buffer.substr(0, length));
+
+        /* Too small a buffer gets as much as fits and the full length. */
+        string clipped(10, '#');
+        ASSERT_TRUE(textile_merge_to_buffer(
+                base.c_str(), base.length(),
+                ours.c_str(), ours.length(),
+                theirs.c_str(), theirs.length(),
+                &clipped[0], 8, &length, NULL, NULL));
+        ASSERT_EQ(golden.length(), length);
+        ASSERT_EQ(golden.substr(0, 8) + "##", clipped);
+
+        struct textile_markers markers = { "<<< ", NULL, " === ", " >>>" };
+        ASSERT_TRUE(textile_merge_to_buffer(
+                base.c_str(), base.length(),
+                ours.c_str(), ours.length(),
+                theirs.c_str(), theirs.length(),
+                &buffer[0], buffer.size(), &length, &markers, NULL));
+        ASSERT_EQ("one <<< 2 === II >>> three FOUR",
+                  buffer.substr(0, length));
+
+        /* A conflict at every other byte is as bad as it gets. */
+        base = "0a0a0a0"; ours = "1a1a1a1"; theirs = "2a2a2a2";
+        bound = textile_merge_bound(base.length(), ours.length(),
+                                    theirs.length(), NULL);
+        ASSERT_TRUE(textile_merge_to_buffer(
+                base.c_str(), base.length(),
+                ours.c_str(), ours.length(),
+                theirs.c_str(), theirs.length(),
+                NULL, 0, &length, NULL, NULL));
+        ASSERT_GE(bound, length);
+        ASSERT_EQ(SIZE_MAX, textile_merge_bound(SIZE_MAX / 2, SIZE_MAX / 2,
+                                                SIZE_MAX / 2, NULL));
+    }
+
+    TEST_F(TextileTest, TestMergeIterator) {
+        string head = lorem(1500, 1), tail = lorem(1500, 3);
+        string base = head + "first one two three" + tail;
+        string ours = head + "FIRST one 2 three" + tail;
+        string theirs = head + "first one II three" + tail + "!";
+        const string *text[3] = { &base, &ours, &theirs };
+
+        ASSERT_TRUE(merge.call_textile_merge(base, ours, theirs));
+
+        struct textile_merge_iter *iter = textile_merge_begin(
+                base.c_str(), base.length(),
+                ours.c_str(), ours.length(),
+                theirs.c_str(), theirs.length(), NULL);
+        ASSERT_TRUE(iter != NULL);
+        ASSERT_FALSE(textile_merge_conflicted(iter));
+
+        ostringstream stream;
+        struct textile_hunk hunk;
+        while (textile_merge_next(iter, &hunk)) {
+            if (hunk.kind == TEXTILE_HUNK_MERGED) {
+                stream << text[hunk.source]->substr(
+                        hunk.offset[hunk.source], hunk.len[hunk.source]);
+                continue;
+            }
+            stream << "<<<<<<<" << ours.substr(hunk.offset[TEXTILE_SOURCE_OURS],
+                                               hunk.len[TEXTILE_SOURCE_OURS])
+                   << "|||||||" << base.substr(hunk.offset[TEXTILE_SOURCE_BASE],
+                                               hunk.len[TEXTILE_SOURCE_BASE])
+                   << "=======" << theirs.substr(
+                                       hunk.offset[TEXTILE_SOURCE_THEIRS],
+                                       hunk.len[TEXTILE_SOURCE_THEIRS])
+                   << ">>>>>>>";
+        }
+        ASSERT_EQ(merge.stream.str(), stream.str());
+        ASSERT_FALSE(textile_merge_next(iter, &hunk));
+        ASSERT_TRUE(textile_merge_conflicted(iter));
+        textile_merge_end(iter);
+
+        /*
+         * Stopping early skips the rest of the walk.  Every other line here
+         * conflicts and is merged again by bytes once the walk gets to it.
+         * Each of those merges hands one LCS to the executor.
+         */
+        base = ours = theirs = "";
+        for (int k = 0; k != 20; ++k) {
+            string line = "line " + to_string(k);
+            base += line + " a b\n" + line + "\n";
+            ours += line + " A b\n" + line + "\n";
+            theirs += line + " a B\n" + line + "\n";
+        }
+        struct textile_options options = textile_options();
+        int submitted = 0;
+        options.flags = TEXTILE_LINES | TEXTILE_CONCURRENT;
+        options.submit = executor_submit;
+        options.executor_data = &submitted;
+
+        iter = textile_merge_begin(
+                base.c_str(), base.length(),
+                ours.c_str(), ours.length(),
+                theirs.c_str(), theirs.length(), &options);
+        size_t hunks = 0;
+        while (textile_merge_next(iter, &hunk))
+            hunks++;
+        textile_merge_end(iter);
+        ASSERT_EQ(21, submitted);
+        ASSERT_LT(2u, hunks);
+
+        submitted = 0;
+        iter = textile_merge_begin(
+                base.c_str(), base.length(),
+                ours.c_str(), ours.length(),
+                theirs.c_str(), theirs.length(), &options);
+        ASSERT_EQ(1, submitted);
+        ASSERT_TRUE(textile_merge_next(iter, &hunk));
+        ASSERT_EQ(TEXTILE_HUNK_MERGED, hunk.kind);
+        textile_merge_end(iter);
+        ASSERT_EQ(2, submitted);
+
+        /* Each merged hunk says where it is in its own input. */
+        string mem = "XabY";
+        iter = textile_merge_begin(mem.data() + 1, 2, mem.data(), 3,
+                                   mem.data() + 1, 3, NULL);
+        ASSERT_TRUE(textile_merge_next(iter, &hunk));
+        ASSERT_EQ(TEXTILE_SOURCE_OURS, hunk.source);
+        ASSERT_EQ(0u, hunk.offset[TEXTILE_SOURCE_OURS]);
+        ASSERT_EQ(3u, hunk.len[TEXTILE_SOURCE_OURS]);
+        ASSERT_TRUE(textile_merge_next(iter, &hunk));
+        ASSERT_EQ(TEXTILE_SOURCE_THEIRS, hunk.source);
+        ASSERT_EQ(2u, hunk.offset[TEXTILE_SOURCE_THEIRS]);
+        ASSERT_EQ(1u, hunk.len[TEXTILE_SOURCE_THEIRS]);
+        ASSERT_FALSE(textile_merge_next(iter, &hunk));
+        textile_merge_end(iter);
+    }
+
+#if __cplusplus >= 202002L
+    TEST_F(TextileTest, TestHunkGenerator) {
+        string head = lorem(1500, 1), tail = lorem(1500, 3);
+        string base = head + "first one two three" + tail;
+        string ours = head + "FIRST one 2 three" + tail;
+        string theirs = head + "first one II three" + tail + "!";
+
+        ASSERT_TRUE(merge.call_textile_merge(base, ours, theirs));
+
+        string generated;
+        for (const textile::hunk &h : textile::hunks(base, ours, theirs)) {
+            if (h.kind == TEXTILE_HUNK_MERGED)
+                generated += h.text;
+            else
+                generated += "<<<<<<<" + string(h.ours) + "|||||||"
+                    + string(h.base) + "=======" + string(h.theirs)
+                    + ">>>>>>>";
+        }
+        ASSERT_EQ(merge.stream.str(), generated);
+
+        /* Leaving the loop early frees the iterator. */
+        for (const textile::hunk &h : textile::hunks(base, ours, theirs)) {
+            ASSERT_EQ(TEXTILE_HUNK_MERGED, h.kind);
+            break;
+        }
+    }
+#endif
+
+    TEST_F(TextileTest, TestCxxMerge) {
+        string base = "one two three four", ours = "one 2 three FOUR",
+               theirs = "one II three four";
+        string golden = "one <<<<<<<2|||||||two=======II>>>>>>> three FOUR";
+
+        string result;
+        int conflicts = 0;
+        ASSERT_TRUE(textile::merge(base, ours, theirs,
+            [&](std::string_view text) { result += text; },
+            [&](std::string_view, std::string_view o, std::string_view t) {
+                result += "[" + string(o) + "/" + string(t) + "]";
+                ++conflicts;
+            }));
+        ASSERT_EQ("one [2/II] three FOUR", result);
+        ASSERT_EQ(1, conflicts);
+
+        bool conflicted = false;
+        ASSERT_EQ(golden, textile::merge_to_string(base, ours, theirs,
+                                                   &conflicted));
+        ASSERT_TRUE(conflicted);
+
+        /* Throwing from a callback is fine. */
+        ASSERT_THROW(textile::merge(base, ours, theirs,
+            [](std::string_view) {},
+            [](std::string_view, std::string_view, std::string_view) {
+                throw std::runtime_error("conflict");
+            }), std::runtime_error);
+
+        /* Same spans and conflicts as the C library at every level. */
+        unsigned flags[] = {
+            0, TEXTILE_LINES, TEXTILE_LINES | TEXTILE_TOKENS,
+            TEXTILE_LINES | TEXTILE_TOKENS | TEXTILE_CASCADE
+        };
+        base = "A shrt strang.\none two three\nfour five\nsix\n";
+        ours = "A short strang.\none 2 three\nfour five\nsix seven\n";
+        theirs = "A shrt string.\none II three\nfour\nsix\n";
+        for (size_t i = 0; i != sizeof flags / sizeof *flags; ++i) {
+            struct textile_options options = textile_options();
+            options.flags = flags[i];
+
+            TextileHelper c, cxx;
+            ASSERT_EQ(c.call_textile_merge(base, ours, theirs, options),
+                textile::merge(base, ours, theirs,
+                    [&](std::string_view text) { cxx.merged(string(text)); },
+                    [&](std::string_view b, std::string_view o,
+                        std::string_view t) {
+                        cxx.conflicted(string(b), string(o), string(t));
+                    }, &options));
+            ASSERT_EQ(c.stream.str(), cxx.stream.str());
+            ASSERT_EQ(c.merged_calls, cxx.merged_calls);
+        }
+    }
+
+    TEST_F(TextileTest, TestMergeUtf16) {
+        std::u16string base = u"Grüße one two three four",
+                       ours = u"Grüße one 2 three FOUR",
+                       theirs = u"\u00e9t\u00e9 Grüße one II three four";
+
+        std::u16string result;
+        ASSERT_TRUE(textile::merge(base, ours, theirs,
+            [&](std::u16string_view text) { result += text; },
+            [&](std::u16string_view, std::u16string_view o,
+                std::u16string_view t) {
+                result += u"<" + std::u16string(o) + u"/"
+                    + std::u16string(t) + u">";
+            }));
+        ASSERT_TRUE(result == u"\u00e9t\u00e9 Grüße one <2/II> three FOUR");
+
+        /* Each engine gives the same answer over code units. */
+        const enum textile_engine engines[] = {
+            TEXTILE_ENGINE_TABLE, TEXTILE_ENGINE_MYERS, TEXTILE_ENGINE_BANDED
+        };
+        for (enum textile_engine engine : engines) {
+            struct textile_options options = textile_options();
+            options.engine = engine;
+            std::u16string again;
+            ASSERT_TRUE(textile::merge(base, ours, theirs,
+                [&](std::u16string_view text) { again += text; },
+                [&](std::u16string_view, std::u16string_view o,
+                    std::u16string_view t) {
+                    again += u"<" + std::u16string(o) + u"/"
+                        + std::u16string(t) + u">";
+                }, &options));
+            ASSERT_TRUE(result == again);
+        }
+
+        std::u16string clean;
+        ASSERT_FALSE(textile::merge(base, base, theirs,
+            [&](std::u16string_view text) { clean += text; },
+            [](std::u16string_view, std::u16string_view,
+               std::u16string_view) {}));
+        ASSERT_TRUE(clean == theirs);
+    }
 }  // namespace
 
 int main(int argc, char **argv) {